@@ -0,0 +1,92 @@
+#include "camera.h"
+#include <cmath>
+
+// Nearest view depth of the first stratum, every further stratum doubles the depth
+const float STRATUM_DEPTH = 1.f;
+// Minimum number of samples for a full confidence
+const size_t MIN_SAMPLES = 16;
+// Temporal filter rate, and the relative change in c/d/e that counts as a new camera (fov change)
+const float FILTER_RATE = 0.2f, CAMERA_CHANGE = 0.05f;
+// Estimates below this confidence do not drive the disparity_correction
+const float MIN_CONFIDENCE = 0.3f;
+const float DEFAULT_DISP_AB[2] = { 6.f, 4e-5f };
+
+void CameraEstimator::reset() {
+	for (int i = 0; i < N_STRATA; i++) stratum_count[i] = 0;
+	n_samples = 0;
+	estimated = false;
+	sum_world = 0;
+	sum_world_view = 0;
+	sum_world_view_proj = 0;
+	Szz = Szw = Sww = Szpz = Swpz = Szpw = Spzpz = Spwpw = 0;
+}
+
+bool CameraEstimator::add(const float4x4 & W, const float4x4 & WV, const float4x4 & WVP) {
+	if (estimated) return false;
+	// Stratify by the view depth of the object origin
+	float z = fabs(WV[3][2]);
+	int s = 0;
+	for (float t = 2 * STRATUM_DEPTH; s < N_STRATA - 1 && z >= t; t *= 2) s++;
+	if (stratum_count[s] >= STRATUM_SAMPLES) return false;
+	// Only well formed affine world matrices
+	if (W[0][3] != 0 || W[1][3] != 0 || W[2][3] != 0 || W[3][3] != 1 || z < STRATUM_DEPTH * 0.1f) return false;
+	stratum_count[s]++;
+	n_samples++;
+
+	::add(&sum_world, sum_world, W);
+	::add(&sum_world_view, sum_world_view, WV);
+	::add(&sum_world_view_proj, sum_world_view_proj, WVP);
+	// WVP[:][3] = d * WV[:][2] and WVP[:][2] = c * WV[:][2] + e * WV[:][3]
+	for (int i = 0; i < 4; i++) {
+		double zz = WV[i][2], ww = WV[i][3], pz = WVP[i][2], pw = WVP[i][3];
+		Szz += zz * zz; Szw += zz * ww; Sww += ww * ww;
+		Szpz += zz * pz; Swpz += ww * pz; Szpw += zz * pw;
+		Spzpz += pz * pz; Spwpw += pw * pw;
+	}
+	return true;
+}
+
+void CameraEstimator::estimate() {
+	if (estimated) return;
+	estimated = true;
+	if (!n_samples) {
+		confidence *= 1 - FILTER_RATE;
+		return;
+	}
+	mul(&view_proj, sum_world.affine_inv(), sum_world_view_proj);
+	mul(&view, sum_world.affine_inv(), sum_world_view);
+
+	double det = Szz * Sww - Szw * Szw;
+	if (Szz <= 0 || Sww <= 0 || det <= 0) {
+		confidence *= 1 - FILTER_RATE;
+		return;
+	}
+	double D = Szpw / Szz, C = (Szpz * Sww - Swpz * Szw) / det, E = (Swpz * Szz - Szpz * Szw) / det;
+	// Relative residual of both fits and conditioning (normalized determinant) of the 2x2 system
+	double res = (Spzpz - 2 * C * Szpz - 2 * E * Swpz + C * C * Szz + 2 * C * E * Szw + E * E * Sww) + (Spwpw - D * Szpw);
+	double rel = fmax(res, 0.) / (Spzpz + Spwpw + 1e-30);
+	double cond = det / (Szz * Sww);
+	float q = (float)(fmin(1., (double)n_samples / MIN_SAMPLES) * sqrt(cond) / (1 + 1e4 * rel));
+
+	if (confidence <= 0 || (q >= MIN_CONFIDENCE && (fabs(C - c) > CAMERA_CHANGE * fabs(c) || fabs(D - d) > CAMERA_CHANGE * fabs(d) || fabs(E - e) > CAMERA_CHANGE * fabs(e)))) {
+		// First estimate or a confident camera change, do not blend across it
+		c = (float)C; d = (float)D; e = (float)E;
+		confidence = q;
+	} else {
+		float r = FILTER_RATE * q;
+		c += r * ((float)C - c);
+		d += r * ((float)D - d);
+		e += r * ((float)E - e);
+		confidence += FILTER_RATE * (q - confidence);
+	}
+}
+
+void CameraEstimator::disparityCorrection(float * disp_ab) const {
+	if (confidence >= MIN_CONFIDENCE && e != 0 && d != 0 && -d / e > 0) {
+		disp_ab[0] = -d / e;
+		disp_ab[1] = -c / d;
+	} else {
+		disp_ab[0] = DEFAULT_DISP_AB[0];
+		disp_ab[1] = DEFAULT_DISP_AB[1];
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "util.h"
+
+// Estimates the camera from a bounded, depth stratified sample of the rigid draws of a frame.
+// The projection matrix is only partially recovered
+//  a 0 0 0
+//  0 b 0 0
+//  0 0 c e
+//  0 0 d 0
+struct CameraEstimator {
+	// Number of view depth strata and samples per stratum
+	static const int N_STRATA = 8, STRATUM_SAMPLES = 8;
+
+	// Start a new frame
+	void reset();
+	// Offer the rage matrices of a draw, returns false if the draw was not sampled (cheap)
+	bool add(const float4x4 & world, const float4x4 & world_view, const float4x4 & world_view_proj);
+	// Solve for the camera of the current frame and update the temporal filter (only the first call per frame does any work)
+	void estimate();
+	size_t samples() const { return n_samples; }
+
+	// Camera of the current frame (valid after estimate)
+	float4x4 view = 0, view_proj = 0;
+	// Temporally filtered projection parameters and the confidence in them [0, 1]
+	float c = 0, d = 0, e = 0, confidence = 0;
+	// The disparity_correction for ps_flow, falls back to the default constants if the estimate is not trusted
+	void disparityCorrection(float * disp_ab) const;
+
+protected:
+	int stratum_count[N_STRATA] = { 0 };
+	size_t n_samples = 0;
+	bool estimated = false;
+	float4x4 sum_world = 0, sum_world_view = 0, sum_world_view_proj = 0;
+	// Normal equations in double
+	double Szz = 0, Szw = 0, Sww = 0, Szpz = 0, Swpz = 0, Szpw = 0, Spzpz = 0, Spwpw = 0;
+};
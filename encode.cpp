@@ -0,0 +1,463 @@
+#include "encode.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+
+static const char STREAM_MAGIC[4] = { 'G', 'H', 'T', 'S' }, CHUNK_MAGIC[4] = { 'C', 'H', 'N', 'K' };
+static const uint32_t STREAM_VERSION = 1;
+static const size_t CHUNK_HEADER_SIZE = 28;
+// Rice coded values are written in blocks sharing one parameter k
+static const size_t RICE_BLOCK = 256;
+// Quotients this large are escaped and written verbatim
+static const uint32_t RICE_ESCAPE = 24;
+
+static double now() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint16_t toHalf(uint32_t f) {
+	uint32_t s = (f >> 16) & 0x8000, e = (f >> 23) & 0xff, m = f & 0x7fffff;
+	if (e == 0xff) // inf and NaN (keep NaN quiet)
+		return (uint16_t)(s | 0x7c00 | (m ? 0x200 | (m >> 13) : 0));
+	int E = (int)e - 127 + 15;
+	if (E >= 0x1f) return (uint16_t)(s | 0x7c00);
+	if (E <= 0) {
+		// Denormal (or zero)
+		if (E < -10) return (uint16_t)s;
+		m |= 0x800000;
+		uint32_t shift = 14 - E, h = m >> shift, r = m & ((1u << shift) - 1), half = 1u << (shift - 1);
+		if (r > half || (r == half && (h & 1))) h++;
+		return (uint16_t)(s | h);
+	}
+	uint32_t h = ((uint32_t)E << 10) | (m >> 13), r = m & 0x1fff;
+	// Round to nearest even, a carry into the exponent is correct (and may produce inf)
+	if (r > 0x1000 || (r == 0x1000 && (h & 1))) h++;
+	return (uint16_t)(s | h);
+}
+static uint32_t fromHalf(uint16_t h) {
+	uint32_t s = (uint32_t)(h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff;
+	if (e == 0x1f) return s | 0x7f800000 | (m << 13);
+	if (e == 0) {
+		if (!m) return s;
+		// Normalize the denormal
+		e = 1;
+		while (!(m & 0x400)) { m <<= 1; e--; }
+		m &= 0x3ff;
+	}
+	return s | ((e + 127 - 15) << 23) | (m << 13);
+}
+
+struct BitWriter {
+	std::vector<uint8_t> & out;
+	uint64_t buf = 0;
+	int n = 0;
+	BitWriter(std::vector<uint8_t> & out) :out(out) {}
+	void put(uint32_t v, int bits) {
+		buf |= (uint64_t)v << n;
+		n += bits;
+		while (n >= 8) {
+			out.push_back((uint8_t)buf);
+			buf >>= 8;
+			n -= 8;
+		}
+	}
+	void flush() {
+		if (n) out.push_back((uint8_t)buf);
+		buf = 0;
+		n = 0;
+	}
+};
+struct BitReader {
+	const uint8_t * p, * e;
+	uint64_t buf = 0;
+	int n = 0;
+	BitReader(const uint8_t * p, const uint8_t * e) :p(p), e(e) {}
+	uint32_t get(int bits) {
+		if (!bits) return 0;
+		while (n < bits) {
+			buf |= (uint64_t)(p < e ? *p++ : 0) << n;
+			n += 8;
+		}
+		uint32_t r = (uint32_t)(buf & ((1ull << bits) - 1));
+		buf >>= bits;
+		n -= bits;
+		return r;
+	}
+	// Drop the partial byte
+	void align() {
+		buf = 0;
+		n = 0;
+	}
+};
+
+static void riceEncode(const std::vector<uint32_t> & v, BitWriter & w) {
+	for (size_t b = 0; b < v.size(); b += RICE_BLOCK) {
+		size_t e = std::min(v.size(), b + RICE_BLOCK);
+		uint64_t sum = 0;
+		for (size_t i = b; i < e; i++) sum += v[i];
+		uint32_t mean = (uint32_t)(sum / (e - b)), k = 0;
+		while (k < 31 && (1ull << (k + 1)) <= mean) k++;
+		w.put(k, 5);
+		for (size_t i = b; i < e; i++) {
+			uint32_t q = v[i] >> k;
+			if (q < RICE_ESCAPE) {
+				w.put((1u << q) - 1, q + 1); // q ones and a zero
+				w.put(v[i] & ((1u << k) - 1), k);
+			} else {
+				w.put((1u << RICE_ESCAPE) - 1, RICE_ESCAPE);
+				w.put(v[i], 32);
+			}
+		}
+	}
+	w.flush();
+}
+static void riceDecode(BitReader & r, size_t n, std::vector<uint32_t> * v) {
+	v->resize(n);
+	for (size_t b = 0; b < n; b += RICE_BLOCK) {
+		size_t e = std::min(n, b + RICE_BLOCK);
+		uint32_t k = r.get(5);
+		for (size_t i = b; i < e; i++) {
+			uint32_t q = 0;
+			while (q < RICE_ESCAPE && r.get(1)) q++;
+			(*v)[i] = q < RICE_ESCAPE ? (q << k) | r.get(k) : r.get(32);
+		}
+	}
+	r.align();
+}
+
+static void put32(std::vector<uint8_t> & o, uint32_t v) {
+	for (int i = 0; i < 4; i++) o.push_back((uint8_t)(v >> (8 * i)));
+}
+static uint32_t get32(const uint8_t * p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static uint32_t floatBits(float f) {
+	uint32_t r;
+	memcpy(&r, &f, sizeof(r));
+	return r;
+}
+static float bitsFloat(uint32_t b) {
+	float r;
+	memcpy(&r, &b, sizeof(r));
+	return r;
+}
+
+EncodedTarget EncodedTarget::fromFloat(uint32_t frame, Channel channel, const float * v, uint32_t W, uint32_t H, uint32_t C, Codec codec, float scale) {
+	EncodedTarget r;
+	r.frame = frame; r.channel = channel; r.codec = codec; r.W = W; r.H = H; r.C = C; r.scale = scale;
+	r.data.resize((size_t)W * H * C);
+	memcpy(r.data.data(), v, r.data.size() * sizeof(float));
+	return r;
+}
+EncodedTarget EncodedTarget::fromId(uint32_t frame, const uint32_t * id, uint32_t W, uint32_t H) {
+	EncodedTarget r;
+	r.frame = frame; r.channel = OBJECT_ID; r.codec = ID_RLE; r.W = W; r.H = H; r.C = 1;
+	r.data.assign(id, id + (size_t)W * H);
+	return r;
+}
+void EncodedTarget::toFloat(float * out) const {
+	memcpy(out, data.data(), data.size() * sizeof(float));
+}
+
+// 16 bit words (half floats or quantized values) as zigzag coded residuals to the left (or upper) neighbor
+static void encodeWords(const std::vector<uint16_t> & h, uint32_t W, uint32_t C, BitWriter & w) {
+	std::vector<uint32_t> r(h.size());
+	const size_t row = (size_t)W * C;
+	for (size_t i = 0; i < h.size(); i++) {
+		uint16_t p = i % row >= C ? h[i - C] : (i >= row ? h[i - row] : 0);
+		int16_t d = (int16_t)(uint16_t)(h[i] - p);
+		r[i] = (uint16_t)(((uint32_t)(uint16_t)d << 1) ^ (uint32_t)(d >> 15));
+	}
+	riceEncode(r, w);
+}
+static void decodeWords(BitReader & br, size_t n, uint32_t W, uint32_t C, std::vector<uint16_t> * h) {
+	std::vector<uint32_t> r;
+	riceDecode(br, n, &r);
+	h->resize(n);
+	const size_t row = (size_t)W * C;
+	for (size_t i = 0; i < n; i++) {
+		uint16_t p = i % row >= C ? (*h)[i - C] : (i >= row ? (*h)[i - row] : 0);
+		uint16_t z = (uint16_t)r[i];
+		(*h)[i] = (uint16_t)(p + (uint16_t)((z >> 1) ^ (0 - (z & 1))));
+	}
+}
+
+std::vector<uint8_t> encodeTarget(const EncodedTarget & t) {
+	std::vector<uint8_t> o(CHUNK_MAGIC, CHUNK_MAGIC + 4);
+	put32(o, t.frame);
+	o.push_back((uint8_t)t.channel);
+	o.push_back((uint8_t)t.codec);
+	o.push_back((uint8_t)t.C);
+	o.push_back(0);
+	put32(o, t.W);
+	put32(o, t.H);
+	put32(o, floatBits(t.scale));
+	put32(o, 0); // Payload size, filled in below
+	BitWriter w(o);
+	const size_t n = t.data.size();
+	if (t.codec == EncodedTarget::RAW) {
+		for (uint32_t v : t.data) put32(o, v);
+	} else if (t.codec == EncodedTarget::FLOAT16 || t.codec == EncodedTarget::QUANTIZED) {
+		std::vector<uint16_t> h(n);
+		if (t.codec == EncodedTarget::FLOAT16)
+			for (size_t i = 0; i < n; i++) h[i] = toHalf(t.data[i]);
+		else
+			for (size_t i = 0; i < n; i++) {
+				float v = bitsFloat(t.data[i]) * t.scale;
+				h[i] = (uint16_t)(int16_t)(std::isnan(v) ? -32768 : std::max(-32767.f, std::min(32767.f, std::round(v))));
+			}
+		encodeWords(h, t.W, t.C, w);
+	} else if (t.codec == EncodedTarget::ID_RLE) {
+		std::vector<uint32_t> value, length;
+		uint32_t last = 0;
+		for (uint32_t y = 0; y < t.H; y++) {
+			const uint32_t * row = t.data.data() + (size_t)y * t.W;
+			for (uint32_t x = 0; x < t.W;) {
+				uint32_t x0 = x;
+				while (x < t.W && row[x] == row[x0]) x++;
+				int32_t d = (int32_t)(row[x0] - last);
+				value.push_back(((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+				length.push_back(x - x0 - 1);
+				last = row[x0];
+			}
+		}
+		put32(o, (uint32_t)value.size());
+		riceEncode(value, w);
+		riceEncode(length, w);
+	}
+	uint32_t payload = (uint32_t)(o.size() - CHUNK_HEADER_SIZE);
+	for (int i = 0; i < 4; i++) o[CHUNK_HEADER_SIZE - 4 + i] = (uint8_t)(payload >> (8 * i));
+	return o;
+}
+
+size_t decodeTarget(const uint8_t * d, size_t n, EncodedTarget * t) {
+	if (n < CHUNK_HEADER_SIZE || memcmp(d, CHUNK_MAGIC, 4)) return 0;
+	t->frame = get32(d + 4);
+	t->channel = (EncodedTarget::Channel)d[8];
+	t->codec = (EncodedTarget::Codec)d[9];
+	t->C = d[10];
+	t->W = get32(d + 12);
+	t->H = get32(d + 16);
+	t->scale = bitsFloat(get32(d + 20));
+	size_t payload = get32(d + 24);
+	if (n < CHUNK_HEADER_SIZE + payload) return 0;
+	const uint8_t * p = d + CHUNK_HEADER_SIZE, * e = p + payload;
+	const size_t N = (size_t)t->W * t->H * t->C;
+	t->data.resize(N);
+	if (t->codec == EncodedTarget::RAW) {
+		if (payload < 4 * N) return 0;
+		for (size_t i = 0; i < N; i++) t->data[i] = get32(p + 4 * i);
+	} else if (t->codec == EncodedTarget::FLOAT16 || t->codec == EncodedTarget::QUANTIZED) {
+		BitReader r(p, e);
+		std::vector<uint16_t> h;
+		decodeWords(r, N, t->W, t->C, &h);
+		if (t->codec == EncodedTarget::FLOAT16)
+			for (size_t i = 0; i < N; i++) t->data[i] = fromHalf(h[i]);
+		else
+			for (size_t i = 0; i < N; i++) {
+				int16_t q = (int16_t)h[i];
+				t->data[i] = floatBits(q == -32768 ? NAN : q / t->scale);
+			}
+	} else if (t->codec == EncodedTarget::ID_RLE) {
+		if (payload < 4) return 0;
+		size_t runs = get32(p);
+		BitReader r(p + 4, e);
+		std::vector<uint32_t> value, length;
+		riceDecode(r, runs, &value);
+		riceDecode(r, runs, &length);
+		size_t i = 0;
+		uint32_t last = 0;
+		for (size_t k = 0; k < runs; k++) {
+			last += (value[k] >> 1) ^ (0 - (value[k] & 1));
+			for (size_t j = 0; j <= length[k] && i < N; j++)
+				t->data[i++] = last;
+		}
+		if (i != N) return 0;
+	} else
+		return 0;
+	return CHUNK_HEADER_SIZE + payload;
+}
+
+StreamEncoder::StreamEncoder(std::ostream & out, int threads, size_t max_pending, bool drop) :out_(out), max_pending_(std::max<size_t>(1, max_pending)), drop_(drop) {
+	std::vector<uint8_t> h(STREAM_MAGIC, STREAM_MAGIC + 4);
+	put32(h, STREAM_VERSION);
+	out_.write((const char*)h.data(), h.size());
+	if (threads <= 0) threads = std::max(1, (int)std::thread::hardware_concurrency());
+	for (int i = 0; i < threads; i++)
+		workers_.emplace_back(&StreamEncoder::work, this);
+}
+StreamEncoder::~StreamEncoder() {
+	flush();
+	{
+		std::lock_guard<std::mutex> lock(m_);
+		stop_ = true;
+	}
+	has_work_.notify_all();
+	for (auto & w : workers_) w.join();
+}
+bool StreamEncoder::push(EncodedTarget && t) {
+	{
+		std::unique_lock<std::mutex> lock(m_);
+		if (pushed_ - written_ >= max_pending_) {
+			// The writer can not keep up
+			if (drop_) {
+				dropped_++;
+				return false;
+			}
+			done_.wait(lock, [this] { return pushed_ - written_ < max_pending_; });
+		}
+		bytes_in_ += t.data.size() * sizeof(uint32_t);
+		queue_.push({ pushed_++, std::move(t) });
+	}
+	has_work_.notify_one();
+	return true;
+}
+void StreamEncoder::flush() {
+	std::unique_lock<std::mutex> lock(m_);
+	done_.wait(lock, [this] { return written_ == pushed_; });
+	out_.flush();
+}
+double StreamEncoder::throughput() const {
+	return busy_ > 0 ? bytes_in_ / busy_ : 0;
+}
+void StreamEncoder::work() {
+	while (1) {
+		std::pair<uint64_t, EncodedTarget> job;
+		{
+			std::unique_lock<std::mutex> lock(m_);
+			has_work_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+			if (queue_.empty()) return;
+			job = std::move(queue_.front());
+			queue_.pop();
+		}
+		double t0 = now();
+		std::vector<uint8_t> chunk = encodeTarget(job.second);
+		double t1 = now();
+
+		std::unique_lock<std::mutex> lock(m_);
+		busy_ += t1 - t0;
+		finished_[job.first].swap(chunk);
+		if (!writing_)
+			write(lock);
+	}
+}
+void StreamEncoder::write(std::unique_lock<std::mutex> & lock) {
+	writing_ = true;
+	while (1) {
+		// Take everything that is ready out of finished_ and write it without holding the lock
+		std::vector<std::vector<uint8_t> > ready;
+		for (auto i = finished_.find(written_ + ready.size()); i != finished_.end(); i = finished_.find(written_ + ready.size())) {
+			ready.push_back(std::move(i->second));
+			finished_.erase(i);
+		}
+		if (ready.empty()) break;
+		lock.unlock();
+		size_t n = 0;
+		for (const auto & c : ready) {
+			out_.write((const char*)c.data(), c.size());
+			n += c.size();
+		}
+		lock.lock();
+		bytes_out_ += n;
+		written_ += ready.size();
+		done_.notify_all();
+	}
+	writing_ = false;
+}
+
+StreamDecoder::StreamDecoder(std::istream & in) :in_(in) {
+	uint8_t h[8];
+	good_ = in_.read((char*)h, sizeof(h)) && !memcmp(h, STREAM_MAGIC, 4) && get32(h + 4) == STREAM_VERSION;
+}
+bool StreamDecoder::next(EncodedTarget * t) {
+	if (!good_) return false;
+	std::vector<uint8_t> chunk(CHUNK_HEADER_SIZE);
+	if (!in_.read((char*)chunk.data(), CHUNK_HEADER_SIZE)) return false;
+	size_t payload = get32(chunk.data() + CHUNK_HEADER_SIZE - 4);
+	chunk.resize(CHUNK_HEADER_SIZE + payload);
+	if (!in_.read((char*)chunk.data() + CHUNK_HEADER_SIZE, payload)) return good_ = false;
+	if (!decodeTarget(chunk.data(), chunk.size(), t)) return good_ = false;
+	return true;
+}
+
+// Synthetic targets of frame f: smooth flow with a sky region (NaN), a depth ramp and a few rectangular objects
+static void syntheticFrame(uint32_t W, uint32_t H, uint32_t f, EncodedTarget t[4]) {
+	std::vector<float> flow(2 * W * H), disparity(W * H), occlusion(W * H);
+	std::vector<uint32_t> id(W * H);
+	for (uint32_t y = 0; y < H; y++)
+		for (uint32_t x = 0; x < W; x++) {
+			size_t i = (size_t)y * W + x;
+			bool sky = y < H / 4;
+			flow[2 * i] = sky ? NAN : 0.01f * x - 0.002f * y + 0.1f * f;
+			flow[2 * i + 1] = sky ? NAN : 0.5f * sinf(0.01f * (x + f));
+			disparity[i] = sky ? 0.f : 1.f / (1.f + 0.1f * (H - y));
+			occlusion[i] = (x + y + f) % 97 == 0 ? 0.5f : 0.f;
+			id[i] = sky ? 0 : 16384 + ((x + 4 * f) / 64) * 7 + (y / 48);
+		}
+	t[0] = EncodedTarget::fromFloat(f, EncodedTarget::FLOW, flow.data(), W, H, 2);
+	t[1] = EncodedTarget::fromFloat(f, EncodedTarget::DISPARITY, disparity.data(), W, H, 1);
+	t[2] = EncodedTarget::fromFloat(f, EncodedTarget::OCCLUSION, occlusion.data(), W, H, 1);
+	t[3] = EncodedTarget::fromId(f, id.data(), W, H);
+}
+
+EncoderBenchmark benchmarkEncoder(uint32_t W, uint32_t H, uint32_t frames, int threads) {
+	// Generate all frames up front, only the encoder pool is timed
+	std::vector<EncodedTarget> targets(4 * (size_t)frames);
+	for (uint32_t f = 0; f < frames; f++)
+		syntheticFrame(W, H, f, &targets[4 * f]);
+	std::stringstream stream;
+	size_t raw = 0, encoded = 0;
+	double t0 = now(), t1;
+	{
+		StreamEncoder enc(stream, threads, targets.size());
+		for (auto & t : targets)
+			enc.push(std::move(t));
+		enc.flush();
+		t1 = now();
+		raw = enc.bytesIn();
+		encoded = enc.bytesOut();
+	}
+
+	// Compare the decoded targets against the (regenerated) sources
+	bool lossless = true;
+	double max_error = 0;
+	StreamDecoder dec(stream);
+	EncodedTarget t, src[4];
+	size_t k = 0;
+	for (; dec.next(&t); k++) {
+		if (k % 4 == 0)
+			syntheticFrame(W, H, (uint32_t)(k / 4), src);
+		const EncodedTarget & s = src[k % 4];
+		if (k >= targets.size() || t.data.size() != s.data.size()) {
+			lossless = false;
+			max_error = INFINITY;
+			break;
+		}
+		lossless = lossless && t.data == s.data;
+		if (s.channel == EncodedTarget::OBJECT_ID) {
+			if (t.data != s.data) max_error = INFINITY;
+			continue;
+		}
+		for (size_t i = 0; i < s.data.size(); i++) {
+			float a = bitsFloat(s.data[i]), b = bitsFloat(t.data[i]);
+			double e = std::isnan(a) || std::isnan(b) ? (std::isnan(a) == std::isnan(b) ? 0. : INFINITY) : fabs((double)a - b);
+			max_error = std::max(max_error, e);
+		}
+	}
+	lossless = lossless && dec.good() && k == targets.size();
+	return { raw / (t1 - t0) / 1e6, encoded ? (double)raw / encoded : 0., lossless, max_error };
+}
+
+#ifdef ENCODE_BENCHMARK
+#include <cstdio>
+#include <cstdlib>
+int main(int argc, char * argv[]) {
+	uint32_t W = argc > 2 ? atoi(argv[1]) : 1920, H = argc > 2 ? atoi(argv[2]) : 1080, frames = argc > 3 ? atoi(argv[3]) : 8;
+	int threads = argc > 4 ? atoi(argv[4]) : 0;
+	EncoderBenchmark b = benchmarkEncoder(W, H, frames, threads);
+	printf("%u x %u x %u frames   %.1f MB/s   ratio %.2f   lossless %d   max error %g\n", W, H, frames, b.mb_per_s, b.ratio, (int)b.lossless, b.max_error);
+	return 0;
+}
+#endif
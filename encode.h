@@ -0,0 +1,95 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Chunked stream of compressed capture targets (flow, disparity, occlusion, object_id, ...)
+// Stream layout: "GHTS" <version:u32> followed by chunks "CHNK" <ChunkHeader> <payload>
+struct EncodedTarget {
+	enum Channel {
+		FLOW = 0,
+		DISPARITY = 1,
+		OCCLUSION = 2,
+		OBJECT_ID = 3,
+		FLOW_DISP = 4,
+	};
+	enum Codec {
+		RAW = 0, // 32 bit words, uncompressed
+		FLOAT16 = 1, // Rounds float32 to half precision (lossy, NaN and inf survive)
+		QUANTIZED = 2, // round(v * scale) as int16, NaN maps to -32768
+		ID_RLE = 3, // Per row runs, delta coded ids and run lengths (object_id only)
+	};
+	uint32_t frame = 0;
+	Channel channel = FLOW;
+	Codec codec = RAW;
+	uint32_t W = 0, H = 0, C = 1;
+	float scale = 1.f;
+	// Pixel data (W x H x C) as 32 bit words, floats are stored bitwise
+	std::vector<uint32_t> data;
+
+	static EncodedTarget fromFloat(uint32_t frame, Channel channel, const float * v, uint32_t W, uint32_t H, uint32_t C, Codec codec = FLOAT16, float scale = 1.f);
+	static EncodedTarget fromId(uint32_t frame, const uint32_t * id, uint32_t W, uint32_t H);
+	void toFloat(float * out) const;
+};
+
+// Compress a single target into a chunk (header and payload)
+std::vector<uint8_t> encodeTarget(const EncodedTarget & t);
+// Decode the chunk at the start of data, returns the number of bytes consumed (0 on error)
+size_t decodeTarget(const uint8_t * data, size_t n, EncodedTarget * t);
+
+// Encodes targets on a worker pool and writes the chunks to out in submission order
+// At most max_pending targets are queued, encoded or waiting to be written; beyond that push blocks (or drops the target if drop is set)
+class StreamEncoder {
+public:
+	StreamEncoder(std::ostream & out, int threads = 0, size_t max_pending = 32, bool drop = false);
+	~StreamEncoder();
+	// Returns false if the target was dropped
+	bool push(EncodedTarget && t);
+	// Wait until all pushed targets are written
+	void flush();
+	size_t bytesIn() const { return bytes_in_; }
+	size_t bytesOut() const { return bytes_out_; }
+	size_t dropped() const { return dropped_; }
+	// Raw bytes encoded per second of (summed) worker time
+	double throughput() const;
+protected:
+	void work();
+	// Write the chunks that are ready (in order), called with m_ locked, only one worker writes at a time
+	void write(std::unique_lock<std::mutex> & lock);
+	std::ostream & out_;
+	std::vector<std::thread> workers_;
+	std::mutex m_;
+	std::condition_variable has_work_, done_;
+	std::queue<std::pair<uint64_t, EncodedTarget> > queue_;
+	std::map<uint64_t, std::vector<uint8_t> > finished_;
+	uint64_t pushed_ = 0, written_ = 0;
+	size_t max_pending_, bytes_in_ = 0, bytes_out_ = 0, dropped_ = 0;
+	double busy_ = 0;
+	bool drop_, stop_ = false, writing_ = false;
+};
+
+class StreamDecoder {
+public:
+	StreamDecoder(std::istream & in);
+	bool good() const { return good_; }
+	bool next(EncodedTarget * t);
+protected:
+	std::istream & in_;
+	bool good_ = false;
+};
+
+struct EncoderBenchmark {
+	double mb_per_s; // Raw megabytes per second through the encoder pool (wall clock, excluding the frame generation)
+	double ratio; // Raw size / encoded size
+	bool lossless; // Decoding reproduced the source targets bit for bit
+	double max_error; // Largest absolute error of the decoded floats (NaN stays NaN, otherwise the error is inf)
+};
+// Encode (and decode) frames of synthetic flow, disparity, occlusion and object_id targets of size W x H
+// Build encode.cpp with ENCODE_BENCHMARK defined for a standalone driver: encode_bench [W H frames threads]
+EncoderBenchmark benchmarkEncoder(uint32_t W, uint32_t H, uint32_t frames, int threads = 0);
@@ -0,0 +1,156 @@
+#include "flow.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <unordered_map>
+#include <emmintrin.h>
+
+template<typename F>
+static void parallelRows(int H, int threads, F f) {
+	if (threads <= 0) threads = std::max(1, (int)std::thread::hardware_concurrency());
+	threads = std::min(threads, H);
+	if (threads <= 1) {
+		f(0, H, 0);
+		return;
+	}
+	std::vector<std::thread> pool;
+	for (int t = 0; t < threads; t++)
+		pool.emplace_back(f, t * H / threads, (t + 1) * H / threads, t);
+	for (auto & t : pool) t.join();
+}
+
+// Bilinear sample with BORDER addressing and a zero border color (SamplerState S in ps_flow)
+static float sampleBorder(const float * I, int W, int H, float u, float v) {
+	float x = u * W - 0.5f, y = v * H - 0.5f;
+	float fx = floorf(x), fy = floorf(y);
+	int x0 = (int)fx, y0 = (int)fy;
+	float ax = x - fx, ay = y - fy;
+#define AT(X,Y) ((X) >= 0 && (X) < W && (Y) >= 0 && (Y) < H ? I[(Y)*W + (X)] : 0.f)
+	return (1 - ay) * ((1 - ax) * AT(x0, y0) + ax * AT(x0 + 1, y0)) + ay * ((1 - ax) * AT(x0, y0 + 1) + ax * AT(x0 + 1, y0 + 1));
+#undef AT
+}
+
+void decodeFlow(const float * flow_disp, const float * prev_disp, int W, int H, const FlowParams & params, float * flow, float * disparity, float * occlusion) {
+	const float NaN = std::numeric_limits<float>::quiet_NaN();
+	// The post pass reads the pixel int(t * (W-1)) at the texture coordinate t of the pixel center
+	std::vector<int> sx(W), sy(H);
+	for (int x = 0; x < W; x++) sx[x] = (int)((x + 0.5f) / W * (W - 1));
+	for (int y = 0; y < H; y++) sy[y] = (int)((y + 0.5f) / H * (H - 1));
+
+	parallelRows(H, params.threads, [&](int y0, int y1, int) {
+		const __m128 a = _mm_set_ps1(params.disp_a), b = _mm_set_ps1(params.disp_b), one = _mm_set_ps1(1.f), half = _mm_set_ps1(0.5f), zero = _mm_setzero_ps(), nan = _mm_set_ps1(NaN);
+		const __m128 fW = _mm_set_ps1((float)W), fH = _mm_set_ps1((float)H);
+		for (int y = y0; y < y1; y++) {
+			const float * row = flow_disp + 4 * (size_t)sy[y] * W;
+			float * flow_row = flow + 2 * (size_t)y * W, * disp_row = disparity + (size_t)y * W, * occ_row = occlusion + (size_t)y * W;
+			const __m128 Ys = _mm_set_ps1((float)sy[y]);
+			for (int x = 0; x < W; x += 4) {
+				int n = std::min(4, W - x);
+				// Load 4 RGBA pixels and transpose them into f.x, f.y, f.z, f.w lanes
+				__m128 p[4];
+				float xs[4] = { 0 };
+				for (int k = 0; k < 4; k++) {
+					int i = k < n ? sx[x + k] : sx[x];
+					p[k] = _mm_loadu_ps(row + 4 * i);
+					xs[k] = (float)i;
+				}
+				_MM_TRANSPOSE4_PS(p[0], p[1], p[2], p[3]);
+				const __m128 fx = p[0], fy = p[1], fz = p[2], fw = p[3];
+
+				__m128 d = _mm_mul_ps(a, _mm_add_ps(fw, b));
+				__m128 o = nan, u = nan, v = nan;
+				if (params.has_flow) {
+					__m128 X = _mm_mul_ps(_mm_mul_ps(_mm_add_ps(fx, one), half), fW), Y = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(one, fy), half), fH);
+					// not(f.z <= 0), NaN counts as valid like in ps_flow
+					__m128 valid = _mm_cmpnle_ps(fz, zero);
+					u = _mm_sub_ps(_mm_sub_ps(X, _mm_loadu_ps(xs)), half);
+					v = _mm_sub_ps(_mm_sub_ps(Y, Ys), half);
+					u = _mm_or_ps(_mm_and_ps(valid, u), _mm_andnot_ps(valid, nan));
+					v = _mm_or_ps(_mm_and_ps(valid, v), _mm_andnot_ps(valid, nan));
+
+					// Occlusion against the prior disparity (gather, the sample position is data dependent)
+					float su[4], sv[4], dd[4];
+					_mm_storeu_ps(su, _mm_mul_ps(_mm_add_ps(fx, one), half));
+					_mm_storeu_ps(sv, _mm_mul_ps(_mm_sub_ps(one, fy), half));
+					for (int k = 0; k < 4; k++)
+						dd[k] = prev_disp ? sampleBorder(prev_disp, W, H, su[k], sv[k]) : 0.f;
+					__m128 prev_d = _mm_mul_ps(a, _mm_add_ps(fz, b));
+					o = _mm_sub_ps(_mm_div_ps(one, prev_d), _mm_div_ps(one, _mm_loadu_ps(dd)));
+				}
+				float r[4][4];
+				_mm_storeu_ps(r[0], u); _mm_storeu_ps(r[1], v); _mm_storeu_ps(r[2], d); _mm_storeu_ps(r[3], o);
+				for (int k = 0; k < n; k++) {
+					flow_row[2 * (x + k)] = r[0][k];
+					flow_row[2 * (x + k) + 1] = r[1][k];
+					disp_row[x + k] = r[2][k];
+					occ_row[x + k] = r[3][k];
+				}
+			}
+		}
+	});
+}
+
+static void merge(ObjectStats & s, const ObjectStats & o) {
+	if (!s.pixels) {
+		s = o;
+		return;
+	}
+	if (!o.pixels) return;
+	s.x0 = std::min(s.x0, o.x0); s.y0 = std::min(s.y0, o.y0);
+	s.x1 = std::max(s.x1, o.x1); s.y1 = std::max(s.y1, o.y1);
+	// flow_x and flow_y hold sums until the very end
+	s.flow_x += o.flow_x; s.flow_y += o.flow_y;
+	if (o.min_depth > 0 && (s.min_depth <= 0 || o.min_depth < s.min_depth)) s.min_depth = o.min_depth;
+	s.max_depth = std::max(s.max_depth, o.max_depth);
+	s.pixels += o.pixels;
+	s.flow_pixels += o.flow_pixels;
+}
+
+std::vector<ObjectStats> objectStats(const uint32_t * object_id, const float * flow, const float * disparity, int W, int H, int threads) {
+	if (threads <= 0) threads = std::max(1, (int)std::thread::hardware_concurrency());
+	std::vector<std::unordered_map<uint32_t, ObjectStats> > partial(std::min(threads, std::max(H, 1)));
+	parallelRows(H, (int)partial.size(), [&](int y0, int y1, int t) {
+		auto & M = partial[t];
+		for (int y = y0; y < y1; y++) {
+			const uint32_t * row = object_id + (size_t)y * W;
+			for (int x = 0; x < W;) {
+				// Aggregate a run of equal ids before touching the map
+				ObjectStats r;
+				r.id = row[x];
+				r.x0 = x; r.y0 = r.y1 = y;
+				for (; x < W && row[x] == r.id; x++) {
+					size_t i = (size_t)y * W + x;
+					if (flow && !std::isnan(flow[2 * i]) && !std::isnan(flow[2 * i + 1])) {
+						r.flow_x += flow[2 * i];
+						r.flow_y += flow[2 * i + 1];
+						r.flow_pixels++;
+					}
+					if (disparity && disparity[i] > 0) {
+						float z = 1.f / disparity[i];
+						if (r.min_depth <= 0 || z < r.min_depth) r.min_depth = z;
+						r.max_depth = std::max(r.max_depth, z);
+					}
+					r.pixels++;
+				}
+				r.x1 = x - 1;
+				merge(M[r.id], r);
+			}
+		}
+	});
+	std::unordered_map<uint32_t, ObjectStats> all;
+	for (const auto & M : partial)
+		for (const auto & i : M)
+			merge(all[i.first], i.second);
+	std::vector<ObjectStats> r;
+	r.reserve(all.size());
+	for (auto & i : all) {
+		if (i.second.flow_pixels) {
+			i.second.flow_x /= i.second.flow_pixels;
+			i.second.flow_y /= i.second.flow_pixels;
+		}
+		r.push_back(i.second);
+	}
+	std::sort(r.begin(), r.end(), [](const ObjectStats & a, const ObjectStats & b) { return a.id < b.id; });
+	return r;
+}
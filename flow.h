@@ -0,0 +1,23 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// CPU version of the ps_flow / ps_noflow post pass, used to decode captured flow_disp targets offline (no GPU or game required)
+struct FlowParams {
+	float disp_a = 6.f, disp_b = 4e-5f; // disparity_correction, disparity = disp_a * (z + disp_b)
+	bool has_flow = true; // ps_flow (true) or ps_noflow (false)
+	int threads = 0; // 0 uses all hardware threads
+};
+// flow_disp is a W x H RGBA32F image, prev_disp the W x H disparity of the prior frame (only required for has_flow).
+// Outputs: flow W x H x 2, disparity and occlusion W x H each. Pixels without valid flow are set to NaN, as on the GPU.
+void decodeFlow(const float * flow_disp, const float * prev_disp, int W, int H, const FlowParams & params, float * flow, float * disparity, float * occlusion);
+
+struct ObjectStats {
+	uint32_t id = 0;
+	uint32_t pixels = 0, flow_pixels = 0;
+	int x0 = 0, y0 = 0, x1 = -1, y1 = -1; // Inclusive bounding box
+	float flow_x = 0, flow_y = 0; // Mean flow over all pixels with valid flow
+	float min_depth = 0, max_depth = 0; // Depth (1 / disparity) range over all pixels with positive disparity
+};
+// Per object aggregates of an object_id target (W x H R32_UINT), flow or disparity may be null. Sorted by id.
+std::vector<ObjectStats> objectStats(const uint32_t * object_id, const float * flow, const float * disparity, int W, int H, int threads = 0);
@@ -7,16 +7,30 @@
 #include <chrono>
 #include <fstream>
 #include <iterator>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include "scripthook\main.h"
 #include "scripthook\natives.h"
 #include "util.h"
 #include "gtastate.h"
+#include "camera.h"
 #include "ps_output.h"
 #include "vs_static.h"
 #include "ps_flow.h"
 #include "ps_noflow.h"
 
 uint32_t MAX_UNTRACKED_OBJECT_ID = 1 << 14;
+// Tracks that have not been drawn for this many frames drop their bone and wheel history
+uint32_t TRACK_EVICTION_AGE = 30;
+// Upper bound on the memory held by all tracks, least recently drawn tracks are trimmed first
+size_t TRACK_MEMORY_BUDGET = 256 << 20;
+// Only every CAPTURE_INTERVAL-th frame runs the tracked draw path, the flow then spans CAPTURE_INTERVAL game frames
+uint32_t CAPTURE_INTERVAL = 1;
+// Time (in seconds) startDraw may spend per frame before tracking fidelity is reduced, 0 disables the governor (e.g. 5e-3)
+double DRAW_BUDGET = 0;
+// Peds further than this (in meters) are the first to lose their bone history under load
+float FAR_DISTANCE = 25.f;
 
 // For debugging, use the current matrices, not the past to estimate the flow
 //#define CURRENT_FLOW
@@ -28,13 +42,15 @@ double time() {
 
 struct TrackData: public TrackedFrame::PrivateData {
 	struct BoneData {
-		float data[255][3][4] = { 0 };
+		// 3x4 bone matrices, sized by the gBoneMtx of the shader that drew them
+		std::vector<float> data;
+		uint32_t frame = 0;
 	};
 	struct WheelData {
 		float4x4 data[2] = { 0 };
 	};
 
-	uint32_t id=0, last_frame=0, has_prev_rage=0, has_cur_rage=0;
+	uint32_t id=0, last_frame=0, has_prev_rage=0, has_cur_rage=0, wheel_count=0, wheels_carried=0;
 	float4x4 prev_rage[4] = { 0 }, cur_rage[4] = { 0 };
 	std::unordered_map<int, BoneData> prev_bones, cur_bones;
 	std::vector<WheelData> prev_wheels, cur_wheels;
@@ -44,6 +60,64 @@ struct TrackData: public TrackedFrame::PrivateData {
 		prev_bones.swap(cur_bones);
 		prev_wheels.swap(cur_wheels);
 	}
+	// Advance to frame on the first draw of the object in that frame
+	void advance(const float4x4 * rage_mat, uint32_t frame) {
+		if (last_frame >= frame) return;
+		swap();
+
+		// Update the rage matrix
+		memcpy(cur_rage, rage_mat, sizeof(cur_rage));
+		has_cur_rage = 1;
+
+		if (last_frame != frame - 1) {
+			// Avoid objects poping in and out
+			has_prev_rage = 0;
+			prev_bones.clear();
+			prev_wheels.clear();
+		}
+		last_frame = frame;
+		wheel_count = 0;
+	}
+	// Fill the wheel slots from on with the previous wheels that are not paired with one of the wheels read back before
+	void carryWheels(uint32_t from) {
+		std::vector<const WheelData*> paired;
+		for (uint32_t k = 0; k < from && k < cur_wheels.size(); k++)
+			paired.push_back(prevWheel(cur_wheels[k]));
+		cur_wheels.resize(std::min<size_t>(from, cur_wheels.size()));
+		for (const auto & p : prev_wheels)
+			if (std::find(paired.begin(), paired.end(), &p) == paired.end())
+				cur_wheels.push_back(p);
+	}
+	// The previous wheel closest to w (wheels are matched by their pose, not by draw order)
+	const WheelData * prevWheel(const WheelData & w) const {
+		const WheelData * r = nullptr;
+		float d = 1e10f;
+		for (const auto & p : prev_wheels) {
+			float dd = D2(Vec3f{ p.data[0][3][0], p.data[0][3][1], p.data[0][3][2] }, Vec3f{ w.data[0][3][0], w.data[0][3][1], w.data[0][3][2] });
+			if (dd < d) {
+				d = dd;
+				r = &p;
+			}
+		}
+		return r;
+	}
+	// Release the bone and wheel history (the next draw starts a fresh history)
+	void trim() {
+		has_prev_rage = has_cur_rage = 0;
+		trimBones();
+		std::vector<WheelData>().swap(prev_wheels);
+		std::vector<WheelData>().swap(cur_wheels);
+	}
+	void trimBones() {
+		std::unordered_map<int, BoneData>().swap(prev_bones);
+		std::unordered_map<int, BoneData>().swap(cur_bones);
+	}
+	size_t memory() const {
+		size_t r = sizeof(TrackData) + (prev_wheels.capacity() + cur_wheels.capacity()) * sizeof(WheelData);
+		for (const auto & b : prev_bones) r += sizeof(BoneData) + b.second.data.capacity() * sizeof(float);
+		for (const auto & b : cur_bones) r += sizeof(BoneData) + b.second.data.capacity() * sizeof(float);
+		return r;
+	}
 };
 struct VehicleTrack {
 	float4x4 rage[4];
@@ -52,8 +126,12 @@ struct VehicleTrack {
 const size_t RAGE_MAT_SIZE = 4 * sizeof(float4x4);
 const size_t VEHICLE_SIZE = RAGE_MAT_SIZE;
 const size_t WHEEL_SIZE = RAGE_MAT_SIZE + 2 * sizeof(float4x4);
+// Largest bone palette, the palette actually read is sized by the shader reflection
 const size_t BONE_MTX_SIZE = 255 * 4 * 3 * sizeof(float);
 
+// Rough half extent of each TrackedFrame::ObjectType, used for the CPU side screen space boxes
+const Vec3f OBJECT_EXTENT[] = { { 0.5f, 0.5f, 0.5f }, { 0.5f, 0.5f, 1.f }, { 2.5f, 2.5f, 1.2f }, { 0.5f, 0.5f, 0.5f }, { 0.3f, 0.3f, 0.3f }, { 0.5f, 0.5f, 1.f } };
+
 struct GTA5 : public GameController {
 	GTA5() : GameController() {
 	}
@@ -67,7 +145,7 @@ struct GTA5 : public GameController {
 		// Write the disparity into a custom render target (this name needs to match the injection shader buffer name!)
 		return { {"flow_disp", TargetType::R32G32B32A32_FLOAT, true}, { "flow", TargetType::R32G32_FLOAT}, { "disparity", TargetType::R32_FLOAT },{ "occlusion", TargetType::R32_FLOAT }, { "object_id", TargetType::R32_UINT } };
 	}
-	CBufferVariable rage_matrices = { "rage_matrices", "gWorld", {0}, {4*16*sizeof(float)} }, wheel_matrices = { "matWheelBuffer", "matWheelWorld",{ 0 },{ 32 * sizeof(float) } }, rage_bonemtx = { "rage_bonemtx", "gBoneMtx",{ 0 },{ BONE_MTX_SIZE } };
+	CBufferVariable rage_matrices = { "rage_matrices", "gWorld", {0}, {4*16*sizeof(float)} }, wheel_matrices = { "matWheelBuffer", "matWheelWorld",{ 0 },{ 32 * sizeof(float) } }, rage_bonemtx = { "rage_bonemtx", "gBoneMtx" };
 	enum ObjectType {
 		UNKNOWN=0,
 		VEHICLE=1,
@@ -144,25 +222,10 @@ struct GTA5 : public GameController {
 
 	virtual void postProcess(uint32_t frame_id) override {
 
-		if (currentRecordingType() != NONE) {
-			// Estimate the projection matrix (or at least a subset of it's values)
-			// a 0 0 0
-			// 0 b 0 0
-			// 0 0 c e
-			// 0 0 d 0
-#define DOT(a,b,i,j) (a[0][i]*b[0][j] + a[1][i]*b[1][j] + a[2][i]*b[2][j] + a[3][i]*b[3][j])
-		// With a bit of math we can see that avg_world_view_proj[:][3] = d * avg_world_view[:][2], below is the least squares estimate for d
-			float d = DOT(avg_world_view_proj, avg_world_view, 3, 2) / DOT(avg_world_view, avg_world_view, 2, 2);
-			// and avg_world_view_proj[:][2] = c * avg_world_view[:][2] + e * avg_world_view[:][3], below is the least squares estimate for c and e
-			float A00 = DOT(avg_world_view, avg_world_view, 2, 2), A10 = DOT(avg_world_view, avg_world_view, 2, 3), A11 = DOT(avg_world_view, avg_world_view, 3, 3);
-			float b0 = DOT(avg_world_view, avg_world_view_proj, 2, 2), b1 = DOT(avg_world_view, avg_world_view_proj, 3, 2);
-
-			float det = 1.f / (A00*A11 - A10 * A10);
-			float c = det * (b0 * A11 - b1 * A10), e = det * (b1 * A00 - b0 * A10);
-
-			// The camera params either change, or there is a ceratin degree of numerical instability (and fov changes, but setting the camera properly is hard ;( )
-			float disp_ab[2] = { 6., 4e-5 }; // { -d / e, -c / d };
-			// LOG(INFO) << "disp_ab " << -d / e << " " << -c / d;
+		if (capturing()) {
+			camera.estimate();
+			float disp_ab[2];
+			camera.disparityCorrection(disp_ab);
 			disparity_correction->set((const float*)disp_ab, 2, 0 * sizeof(float));
 			bindCBuffer(disparity_correction);
 
@@ -173,18 +236,80 @@ struct GTA5 : public GameController {
 		}
 	}
 
-	float4x4 avg_world = 0, avg_world_view = 0, avg_world_view_proj = 0, prev_view = 0, prev_view_proj = 0;
-	uint8_t main_render_pass = 0;
-	uint32_t oid = 1, base_id = 1;
+	CameraEstimator camera;
+	std::mutex camera_mutex;
+	float4x4 prev_view = 0, prev_view_proj = 0;
+	std::atomic<uint8_t> main_render_pass = { 0 };
+	std::atomic<uint32_t> oid = { 1 };
+	uint32_t base_id = 1;
 	std::shared_ptr<CBuffer> id_buffer, prev_buffer, prev_wheel_buffer, prev_rage_bonemtx, disparity_correction;
 	TrackedFrame * tracker = nullptr;
-	std::shared_ptr<TrackData> last_vehicle;
 	double start_time;
-	uint32_t current_frame_id = 1, wheel_count = 0;
+	uint32_t current_frame_id = 1;
+
+	// Draws may be submitted from several threads (deferred contexts). draw_mutex guards the tracks, the draw statistics and
+	// the shared CBuffers, GPU readbacks are never done while holding it.
+	std::mutex draw_mutex;
+	// Draw state of a single submission context (thread), reset every frame
+	struct DrawContext {
+		uint32_t frame = 0;
+		std::shared_ptr<TrackData> last_vehicle;
+	};
+	std::atomic<uint32_t> frame_count = { 0 };
+	DrawContext & drawContext() {
+		static thread_local DrawContext ctx;
+		if (ctx.frame != frame_count) {
+			ctx = DrawContext();
+			ctx.frame = frame_count;
+		}
+		return ctx;
+	}
+	// Instanced draws of this frame (id, number of instances)
+	std::vector<std::pair<uint32_t, uint32_t> > instanced;
+
+	std::atomic<size_t> TS = { 0 };
 
-	size_t TS = 0;
+	// Work shed (in this order) when startDraw exceeds its DRAW_BUDGET
+	enum Fidelity {
+		FULL = 0,
+		NO_FAR_BONES = 1, // Distant peds reuse their last bone matrices instead of reading them back
+		NO_WHEELS = 2, // Wheels reuse their previous matrices
+		NO_UNTRACKED = 3, // Unknown objects are not associated with the tracker
+	};
+	std::atomic<uint64_t> draw_ns = { 0 };
+	double drawTime() const {
+		return draw_ns * 1e-9;
+	}
+	uint8_t frame_fidelity = FULL;
+	std::atomic<uint8_t> last_fidelity = { FULL };
+	// Objects that got degraded this frame (id, Fidelity), and the number of unknown objects not associated
+	std::unordered_map<uint32_t, uint8_t> degraded;
+	uint32_t skipped_untracked = 0;
+	uint8_t fidelity() {
+		uint8_t f = FULL;
+		if (DRAW_BUDGET > 0) {
+			double draw_time = drawTime();
+			if (draw_time > DRAW_BUDGET) f = NO_UNTRACKED;
+			else if (draw_time > 0.75 * DRAW_BUDGET) f = NO_WHEELS;
+			else if (draw_time > 0.5 * DRAW_BUDGET) f = NO_FAR_BONES;
+		}
+		f = std::max(f, frame_fidelity);
+		last_fidelity = f;
+		return f;
+	}
+	void degrade(uint32_t id, uint8_t f) {
+		uint8_t & d = degraded[id];
+		d = std::max(d, f);
+	}
+
+	// Skipped frames leave all history (tracks, camera and prev_disp) untouched, current_frame_id only counts captured frames
+	bool capture_frame = true;
+	bool capturing() const {
+		return capture_frame && currentRecordingType() != NONE;
+	}
 	virtual void startFrame(uint32_t frame_id) override {
 		start_time = time();
+		capture_frame = CAPTURE_INTERVAL <= 1 || frame_id % CAPTURE_INTERVAL == 0;
 
 		main_render_pass = 2;
 		albedo_output = RenderTargetView();
@@ -195,30 +320,124 @@ struct GTA5 : public GameController {
 		if (!prev_rage_bonemtx) prev_rage_bonemtx = createCBuffer("prev_rage_bonemtx", BONE_MTX_SIZE);
 		if (!disparity_correction) disparity_correction = createCBuffer("disparity_correction", 2*sizeof(float));
 		base_id = oid = 1;
-		last_vehicle.reset();
-		wheel_count = 0;
-		tracker = trackNextFrame();
+		instanced.clear();
+		frame_count++;
+		tracker = trackNextFrame(start_time);
 
-		avg_world = 0;
-		avg_world_view = 0;
-		avg_world_view_proj = 0;
+		camera.reset();
 		TS = 0;
+		// Boxes are only projected on captured frames, never export the ones of an earlier frame
+		box_id.clear();
+		box.clear();
+		box_corners.clear();
+
+		// Start at one level below where the last frame ended up
+		frame_fidelity = last_fidelity > FULL ? (uint8_t)(last_fidelity - 1) : (uint8_t)FULL;
+		last_fidelity = frame_fidelity;
+		draw_ns = 0;
+		degraded.clear();
+		skipped_untracked = 0;
 	}
 	virtual void endFrame(uint32_t frame_id) override {
-		if (currentRecordingType() != NONE) {
-			mul(&prev_view_proj, avg_world.affine_inv(), avg_world_view_proj);
-			mul(&prev_view, avg_world.affine_inv(), avg_world_view);
+		if (capturing()) {
+			camera.estimate();
+			if (camera.samples()) {
+				prev_view_proj = camera.view_proj;
+				prev_view = camera.view;
+			}
 			current_frame_id++;
 
 			// Copy the disparity buffer for occlusion testing
 			copyTarget("prev_disp", "disparity");
 
-			LOG(INFO) << "T = " << time() - start_time << "   S = " << TS;
+			evictTracks();
+			projectObjects();
+
+			LOG(INFO) << "T = " << time() - start_time << "   S = " << TS << "   D = " << drawTime() << "   F = " << (int)last_fidelity.load();
+			if (instanced.size()) {
+				uint32_t instances = 0, max_instances = 0;
+				for (const auto & i : instanced) {
+					instances += i.second;
+					max_instances = std::max(max_instances, i.second);
+				}
+				LOG(INFO) << "Instanced draws = " << instanced.size() << "   instances = " << instances << "   max instances per draw = " << max_instances;
+			}
+		}
+	}
+	// Screen space boxes of all tracked objects in the current frame
+	std::vector<uint32_t> box_id;
+	std::vector<Box2f> box;
+	// World space corners of the oriented boxes (8 per box, xyz each)
+	std::vector<float> box_corners;
+	void projectObjects() {
+		box_id.clear();
+		box.clear();
+		box_corners.clear();
+		if (!tracker) return;
+		std::vector<float> center, rot, lo, hi;
+		// The upper half of the tracker holds the ped head gear
+		for (uint32_t i : tracker->occupied)
+			if (i < N_OBJECTS / 2) {
+				const TrackedFrame::Object & o = tracker->objects[i];
+				box_id.push_back(MAX_UNTRACKED_OBJECT_ID + o.id);
+				center.insert(center.end(), { o.p.x, o.p.y, o.p.z });
+				rot.insert(rot.end(), { o.q.x, o.q.y, o.q.z, o.q.w });
+				if (o.lo == o.hi) {
+					// No model dimensions, fall back to the rough extent of the type
+					Vec3f e = OBJECT_EXTENT[o.type() % (sizeof(OBJECT_EXTENT) / sizeof(OBJECT_EXTENT[0]))];
+					lo.insert(lo.end(), { -e.x, -e.y, -e.z });
+					hi.insert(hi.end(), { e.x, e.y, e.z });
+				} else {
+					lo.insert(lo.end(), { o.lo.x, o.lo.y, o.lo.z });
+					hi.insert(hi.end(), { o.hi.x, o.hi.y, o.hi.z });
+				}
+			}
+		box.resize(box_id.size());
+		box_corners.resize(24 * box_id.size());
+		orientedBoxes(center.data(), rot.data(), lo.data(), hi.data(), box_id.size(), box_corners.data());
+		// prev_view_proj was just updated to the view projection of this frame
+		projectBoxes(&prev_view_proj.d[0][0], box_corners.data(), box_id.size(), (float)defaultWidth(), (float)defaultHeight(), box.data());
+	}
+	void evictTracks() {
+		if (!tracker) return;
+		// Resident track memory per TrackedFrame::ObjectType
+		size_t memory[8] = { 0 }, total = 0;
+		std::vector<std::pair<uint32_t, TrackData*> > lru;
+		for (uint32_t i : tracker->occupied) {
+			const TrackedFrame::Object & o = tracker->objects[i];
+			TrackData * track = dynamic_cast<TrackData*>(o.private_data.get());
+			if (!track) continue;
+			if (track->last_frame + TRACK_EVICTION_AGE < current_frame_id)
+				track->trim();
+			size_t m = track->memory();
+			memory[o.type() & 7] += m;
+			total += m;
+			// Tracks drawn this frame keep their bones (current_frame_id was already advanced)
+			if ((track->prev_bones.size() || track->cur_bones.size()) && track->last_frame + 1 < current_frame_id)
+				lru.push_back({ track->last_frame, track });
+		}
+		if (total > TRACK_MEMORY_BUDGET) {
+			// Drop the bone history of the least recently drawn tracks first
+			std::sort(lru.begin(), lru.end(), [](const std::pair<uint32_t, TrackData*> & a, const std::pair<uint32_t, TrackData*> & b) { return a.first < b.first; });
+			for (size_t i = 0; i < lru.size() && total > TRACK_MEMORY_BUDGET; i++) {
+				size_t m = lru[i].second->memory();
+				lru[i].second->trimBones();
+				total -= m - lru[i].second->memory();
+			}
+			LOG(INFO) << "Track memory over budget, trimmed to " << total;
 		}
+		LOG(INFO) << "Track memory  ped = " << memory[TrackedFrame::PED] + memory[TrackedFrame::PLAYER] << "   vehicle = " << memory[TrackedFrame::VEHICLE] << "   object = " << memory[TrackedFrame::OBJECT] + memory[TrackedFrame::PICKUP] + memory[TrackedFrame::UNKNOWN];
 	}
 	RenderTargetView albedo_output;
 	virtual DrawType startDraw(const DrawInfo & info) override {
-		if ((currentRecordingType() != NONE) && info.outputs.size() && info.outputs[0].W == defaultWidth() && info.outputs[0].H == defaultHeight() && info.outputs.size() >= 2 && info.type == DrawInfo::INDEX && info.instances == 0) {
+		// A monotonic clock, time() may jump
+		auto t0 = std::chrono::steady_clock::now();
+		DrawType r = trackDraw(info);
+		draw_ns += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+		return r;
+	}
+	DrawType trackDraw(const DrawInfo & info) {
+		if (capturing() && info.outputs.size() && info.outputs[0].W == defaultWidth() && info.outputs[0].H == defaultHeight() && info.outputs.size() >= 2 && info.type == DrawInfo::INDEX) {
 			bool has_rage_matrices = rage_matrices.has(info.vertex_shader);
 			ObjectType type = UNKNOWN;
 			{
@@ -229,9 +448,12 @@ struct GTA5 : public GameController {
 			if (has_rage_matrices && main_render_pass > 0) {
 				std::shared_ptr<GPUMemory> wp = rage_matrices.fetch(this, info.vertex_shader, info.vs_cbuffers, true);
 				if (main_render_pass == 2) {
-					// Starting the main render pass
-					albedo_output = info.outputs[0];
-					main_render_pass = 1;
+					std::lock_guard<std::mutex> lock(draw_mutex);
+					if (main_render_pass == 2) {
+						// Starting the main render pass (the output is set before the pass is published)
+						albedo_output = info.outputs[0];
+						main_render_pass = 1;
+					}
 				}
 				if (main_render_pass == 1) {
 					uint32_t id = 0;
@@ -242,30 +464,82 @@ struct GTA5 : public GameController {
 						mul(&prev_rage[2], rage_mat[0], prev_view_proj);
 						mul(&prev_rage[1], rage_mat[0], prev_view);
 
-						// Sum up the world and world_view_proj matrices to later compute the view_proj matrix
+						// Sample the world, world_view and world_view_proj matrices to later compute the camera
 						if (type != PEDESTRIAN && type != PLAYER) {
 							// There is a 'BUG' (or feature) in GTA V that doesn't draw Franklyn correctly in first person view (rage_mat are wrong)
-							add(&avg_world, avg_world, rage_mat[0]);
-							add(&avg_world_view, avg_world_view, rage_mat[1]);
-							add(&avg_world_view_proj, avg_world_view_proj, rage_mat[2]);
+							std::lock_guard<std::mutex> lock(camera_mutex);
+							camera.add(rage_mat[0], rage_mat[1], rage_mat[2]);
 						}
 
-						if (type == WHEEL && last_vehicle) {
-							std::shared_ptr<GPUMemory> wm = wheel_matrices.fetch(this, info.vertex_shader, info.vs_cbuffers, true);
-							if (wm && wm->size() >= 2 * sizeof(float4x4)) {
-								if (last_vehicle->cur_wheels.size() <= wheel_count)
-									last_vehicle->cur_wheels.resize(wheel_count + 1);
-								memcpy(&last_vehicle->cur_wheels[wheel_count], wm->data(), sizeof(TrackData::WheelData));
-
-								// Set the previous wheel matrix
-								if (wheel_count < last_vehicle->prev_wheels.size())
-									prev_wheel_buffer->set(last_vehicle->prev_wheels[wheel_count]);
-								else
-									prev_wheel_buffer->set(last_vehicle->cur_wheels[wheel_count]);
+						// Immediate readbacks stall this thread on the GPU, do them before taking draw_mutex (unless the governor skips them)
+						bool has_bone_mtx = type == PEDESTRIAN || type == BONE_MTX;
+						bool distant = D2(Vec3f{ rage_mat[1].d[3][0], rage_mat[1].d[3][1], rage_mat[1].d[3][2] }, Vec3f{ 0, 0, 0 }) > FAR_DISTANCE * FAR_DISTANCE;
+						bool skip_bones = has_bone_mtx && !info.instances && distant && fidelity() >= NO_FAR_BONES, skip_wheel = type == WHEEL && !info.instances && fidelity() >= NO_WHEELS;
+						std::shared_ptr<GPUMemory> bm, wm;
+						if (has_bone_mtx && !skip_bones)
+							bm = rage_bonemtx.fetch(this, info.vertex_shader, info.vs_cbuffers, true);
+						if (type == WHEEL && !skip_wheel)
+							wm = wheel_matrices.fetch(this, info.vertex_shader, info.vs_cbuffers, true);
+						if (wm && wm->size() < 2 * sizeof(float4x4))
+							wm.reset();
+
+						if (info.instances > 0) {
+							// Instanced geometry (vegetation, props) is not tracked, all instances share one id and the transforms read above.
+							// The injected vertex shader has no way to forward SV_InstanceID, so ids cannot be assigned per instance.
+							// The injected shader reads the previous bones / wheel matrices, instances have no history so they use the current ones
+							if ((has_bone_mtx && !bm) || (type == WHEEL && !wm)) return DEFAULT;
+							uint32_t o = oid++;
+							if (o < MAX_UNTRACKED_OBJECT_ID)
+								id = o;
+							std::lock_guard<std::mutex> lock(draw_mutex);
+							if (bm) {
+								prev_rage_bonemtx->set((const float*)bm->data(), std::min(bm->size(), BONE_MTX_SIZE) / sizeof(float), 0);
+								bindCBuffer(prev_rage_bonemtx);
+							} else if (wm) {
+								prev_wheel_buffer->set((const float4x4*)wm->data(), 2, 0);
 								bindCBuffer(prev_wheel_buffer);
 							}
-							id = last_vehicle->id;
-							wheel_count++;
+							instanced.push_back({ id, (uint32_t)info.instances });
+							return bindRigid(prev_rage, id);
+						}
+
+						std::unique_lock<std::mutex> lock(draw_mutex);
+						if (std::shared_ptr<TrackData> vehicle = type == WHEEL ? wheelVehicle(rage_mat) : nullptr) {
+							vehicle->advance(rage_mat, current_frame_id);
+							uint32_t w = vehicle->wheel_count++;
+							if (vehicle->cur_wheels.size() <= w)
+								vehicle->cur_wheels.resize(w + 1);
+							if (w < vehicle->prev_wheels.size() && skip_wheel) {
+								// Skip the readback, the previous wheels not read back this frame carry over as a set (keyed by pose, not draw order)
+								if (vehicle->wheels_carried != current_frame_id) {
+									vehicle->carryWheels(w);
+									vehicle->wheels_carried = current_frame_id;
+								}
+								// Without the readback the wheel has no pose of its own, it takes one of the carried over wheels
+								prev_wheel_buffer->set(*vehicle->prevWheel(vehicle->cur_wheels[w]));
+								bindCBuffer(prev_wheel_buffer);
+								degrade(vehicle->id, NO_WHEELS);
+							} else {
+								if (skip_wheel) {
+									// The governor skipped the readback, but this wheel has no history to fall back on
+									lock.unlock();
+									wm = wheel_matrices.fetch(this, info.vertex_shader, info.vs_cbuffers, true);
+									lock.lock();
+									if (vehicle->cur_wheels.size() <= w)
+										vehicle->cur_wheels.resize(w + 1);
+								}
+								if (wm && wm->size() >= 2 * sizeof(float4x4)) {
+									memcpy(&vehicle->cur_wheels[w], wm->data(), sizeof(TrackData::WheelData));
+
+									// Set the previous wheel matrix
+									if (const TrackData::WheelData * prev = vehicle->prevWheel(vehicle->cur_wheels[w]))
+										prev_wheel_buffer->set(*prev);
+									else
+										prev_wheel_buffer->set(vehicle->cur_wheels[w]);
+									bindCBuffer(prev_wheel_buffer);
+								}
+							}
+							id = vehicle->id;
 						} else if (tracker) {
 							// Determine the GTA type for search
 							TrackedFrame::ObjectType gta_type = TrackedFrame::UNKNOWN;
@@ -277,7 +551,10 @@ struct GTA5 : public GameController {
 
 							TrackedFrame::Object * object;
 							// A tighter radius for unknown objects
-							if (gta_type == TrackedFrame::UNKNOWN) object = (*tracker)(v, Quaternion::fromMatrix(rage_mat[0]), 0.01f, 0.01f, gta_type);
+							if (gta_type == TrackedFrame::UNKNOWN && fidelity() >= NO_UNTRACKED) {
+								object = nullptr;
+								skipped_untracked++;
+							} else if (gta_type == TrackedFrame::UNKNOWN) object = (*tracker)(v, Quaternion::fromMatrix(rage_mat[0]), 0.01f, 0.01f, gta_type);
 							else if (gta_type == TrackedFrame::PED) object = (*tracker)(v, Quaternion::fromMatrix(rage_mat[0]), 1.f, 10.f, gta_type);
 							else object = (*tracker)(v, Quaternion::fromMatrix(rage_mat[0]), 0.1f, 0.1f, TrackedFrame::UNKNOWN);
 
@@ -287,32 +564,36 @@ struct GTA5 : public GameController {
 									object->private_data = track = std::make_shared<TrackData>();
 								if (object->type() == TrackedFrame::PLAYER) type = PLAYER;
 								// Advance a tracked frame
-								if (track->last_frame < current_frame_id) {
-
-									// Advance time
-									track->swap();
-
-									// Update the rage matrix
-									memcpy(track->cur_rage, rage_mat, sizeof(track->cur_rage));
-									track->has_cur_rage = 1;
-
-									if (track->last_frame != current_frame_id - 1) {
-										// Avoid objects poping in and out
-										track->has_prev_rage = 0;
-										track->prev_bones.clear();
-										track->prev_wheels.clear();
+								track->advance(rage_mat, current_frame_id);
+								// Update the bone_mtx (distant peds keep their last bones under load)
+								bool has_bones = track->cur_bones.count(info.vertex_buffer.id) || track->prev_bones.count(info.vertex_buffer.id);
+								if (skip_bones && has_bones) {
+									degrade(MAX_UNTRACKED_OBJECT_ID + object->id, NO_FAR_BONES);
+									// Skip the readback, the previous bones carry over to this frame
+									TrackData::BoneData & bones = track->cur_bones[info.vertex_buffer.id];
+									if (bones.frame != current_frame_id) {
+										auto prev = track->prev_bones.find(info.vertex_buffer.id);
+										if (prev != track->prev_bones.end())
+											bones.data = prev->second.data;
+										bones.frame = current_frame_id;
+									}
+								} else if (has_bone_mtx) {
+									if (skip_bones) {
+										// The governor skipped the readback, but this ped has no bones to fall back on
+										lock.unlock();
+										bm = rage_bonemtx.fetch(this, info.vertex_shader, info.vs_cbuffers, true);
+										lock.lock();
 									}
-									track->last_frame = current_frame_id;
-								}
-								// Update the bone_mtx
-								if (type == PEDESTRIAN || type == BONE_MTX) {
-									std::shared_ptr<GPUMemory> bm = rage_bonemtx.fetch(this, info.vertex_shader, info.vs_cbuffers, true);
 									if (bm) {
-										if (!track->cur_bones.count(info.vertex_buffer.id)) {
-											memcpy(&track->cur_bones[info.vertex_buffer.id], bm->data(), sizeof(TrackData::BoneData));
-											TS += sizeof(TrackData::BoneData);
+										TrackData::BoneData & bones = track->cur_bones[info.vertex_buffer.id];
+										size_t n = std::min(bm->size(), BONE_MTX_SIZE) / sizeof(float);
+										if (bones.frame != current_frame_id) {
+											// The first draw of this frame, cur_bones might still hold the bones of two frames ago
+											bones.data.assign((const float*)bm->data(), (const float*)bm->data() + n);
+											bones.frame = current_frame_id;
+											TS += n * sizeof(float);
 										} else if (0) {
-											if (memcmp(&track->cur_bones[info.vertex_buffer.id], bm->data(), sizeof(TrackData::BoneData))) {
+											if (bones.data.size() != n || memcmp(bones.data.data(), bm->data(), n * sizeof(float))) {
 												LOG(WARN) << "Bone matrix changed for object " << info.pixel_shader << " " << info.vertex_shader << " " << info.vertex_buffer.id;
 												LOG(INFO) << object->type() << " " << object->id;
 												return HIDE;
@@ -325,40 +606,64 @@ struct GTA5 : public GameController {
 									memcpy(prev_rage, &track->prev_rage, sizeof(prev_rage));
 
 								// Set the prior bone mtx
-								if (type == PEDESTRIAN || type == BONE_MTX) {
+								if (has_bone_mtx) {
+									const std::vector<float> * bones = nullptr;
 									if (track->prev_bones.count(info.vertex_buffer.id))
-										prev_rage_bonemtx->set(track->prev_bones[info.vertex_buffer.id]);
+										bones = &track->prev_bones[info.vertex_buffer.id].data;
 									else if (track->cur_bones.count(info.vertex_buffer.id))
-										prev_rage_bonemtx->set(track->cur_bones[info.vertex_buffer.id]);
+										bones = &track->cur_bones[info.vertex_buffer.id].data;
+									// Only upload the part of the palette the shader uses
+									if (bones && bones->size())
+										prev_rage_bonemtx->set(bones->data(), bones->size(), 0);
 									bindCBuffer(prev_rage_bonemtx);
 								}
 
 								track->id = id = MAX_UNTRACKED_OBJECT_ID + object->id;
-								if (type == VEHICLE) {
-									last_vehicle = track;
-									wheel_count = 0;
-								}
+								if (type == VEHICLE)
+									drawContext().last_vehicle = track;
 							}
 							else if (type == PEDESTRIAN) {
 								return HIDE;
 							}
 						}
-						prev_buffer->set((float4x4*)prev_rage, 4, 0);
-						bindCBuffer(prev_buffer);
-
-						id_buffer->set(id);
-						bindCBuffer(id_buffer);
-						return RIGID;
+						return bindRigid(prev_rage, id);
 					}
 				}
 			}
 		} else if (main_render_pass == 1) {
-			// End of the main render pass
-			copyTarget("albedo", albedo_output);
-			main_render_pass = 0;
+			std::lock_guard<std::mutex> lock(draw_mutex);
+			if (main_render_pass == 1) {
+				// End of the main render pass
+				copyTarget("albedo", albedo_output);
+				main_render_pass = 0;
+			}
 		}
 		return DEFAULT;
 	}
+	// Bind the prior rage matrices and the object id of a rigid draw (draw_mutex held)
+	DrawType bindRigid(const float4x4 prev_rage[4], uint32_t id) {
+		prev_buffer->set(prev_rage, 4, 0);
+		bindCBuffer(prev_buffer);
+
+		id_buffer->set(id);
+		bindCBuffer(id_buffer);
+		return RIGID;
+	}
+	// The vehicle a wheel draw belongs to: the tracked vehicle at the pose of the wheel draw (it shares the vehicle's gWorld),
+	// or the last vehicle drawn in the same submission context
+	std::shared_ptr<TrackData> wheelVehicle(const float4x4 * rage_mat) {
+		if (tracker) {
+			Vec3f v = { rage_mat[0].d[3][0], rage_mat[0].d[3][1], rage_mat[0].d[3][2] };
+			if (TrackedFrame::Object * parent = (*tracker)(v, Quaternion::fromMatrix(rage_mat[0]), 0.1f, 0.1f, TrackedFrame::VEHICLE)) {
+				std::shared_ptr<TrackData> track = std::dynamic_pointer_cast<TrackData>(parent->private_data);
+				if (!track)
+					parent->private_data = track = std::make_shared<TrackData>();
+				track->id = MAX_UNTRACKED_OBJECT_ID + parent->id;
+				return track;
+			}
+		}
+		return drawContext().last_vehicle;
+	}
 	virtual void endDraw(const DrawInfo & info) override {
 		if (final_shader.count(info.pixel_shader)) {
 			// Draw the final image (right before the image is distorted)
@@ -366,8 +671,34 @@ struct GTA5 : public GameController {
 		}
 	}
 	virtual std::string gameState() const override {
-		if (tracker)
-			return toJSON(tracker->info);
+		if (tracker) {
+			std::string r = toJSON(tracker->info), objects;
+			// Every tracked object has an oriented box, only the ones in view have a screen space box and depth
+			for (size_t i = 0; i < box.size(); i++) {
+				std::string b = box[i].visible ? toJSON(box[i]) : "{\"visible\":0}", c;
+				addJSON(&b, "id", std::to_string(box_id[i]));
+				for (int k = 0; k < 8; k++) {
+					const float * v = &box_corners[24 * i + 3 * k];
+					c += (k ? "," : "") + toJSON(Vec3f{ v[0], v[1], v[2] });
+				}
+				addJSON(&b, "obb", "[" + c + "]");
+				objects += (objects.size() ? "," : "") + b;
+			}
+			addJSON(&r, "objects", "[" + objects + "]");
+			std::string d;
+			for (const auto & i : degraded)
+				d += (d.size() ? ",[" : "[") + std::to_string(i.first) + "," + std::to_string(i.second) + "]";
+			addJSON(&r, "degraded", "[" + d + "]");
+			addJSON(&r, "degraded_untracked", std::to_string(skipped_untracked));
+			std::string in;
+			for (const auto & i : instanced)
+				in += (in.size() ? ",[" : "[") + std::to_string(i.first) + "," + std::to_string(i.second) + "]";
+			addJSON(&r, "instanced", "[" + in + "]");
+			addJSON(&r, "camera_confidence", std::to_string(camera.confidence));
+			addJSON(&r, "captured", std::to_string((int)capture_frame));
+			addJSON(&r, "capture_interval", std::to_string(CAPTURE_INTERVAL));
+			return r;
+		}
 		return "";
 	}
 	virtual bool stop() { return stopTracker(); }
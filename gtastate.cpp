@@ -7,55 +7,116 @@
 #include <string>
 #include <ostream>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
 #include <Windows.h>
 
 const float TRACKING_RAD = 0.5f;
 const float TRACKING_QUAT = 0.1f;
 
+// N_SNAPSHOTS Number of tracker snapshots in flight (one is fetched, one indexed, one held by the renderer)
+#define N_SNAPSHOTS 6
+
+double trackerTime() {
+	auto now = std::chrono::system_clock::now();
+	return std::chrono::duration<double>(now.time_since_epoch()).count();
+}
+
 struct Tracker {
 	static std::mutex is_tracking;
-	static TrackedFrame current, returned;
-	static uint64_t current_id, returned_id;
-	static bool stop_tracking, currently_tracking;
+	// Snapshots are immutable once published, only the renderer touches age and private_data of the one it holds
+	static std::shared_ptr<TrackedFrame> snapshots[N_SNAPSHOTS], returned;
+	static uint64_t current_id;
+	static std::atomic<bool> stop_tracking;
+	static bool currently_tracking;
+	// Raw entity sweep waiting to be indexed by the worker (only the latest one is kept)
+	static std::shared_ptr<TrackedFrame> pending;
+	static std::condition_variable has_pending;
 
+	// Builds the spatial index off the script and render threads and publishes the snapshot
+	static void Index() {
+		while (1) {
+			std::shared_ptr<TrackedFrame> f;
+			{
+				std::unique_lock<std::mutex> lock(is_tracking);
+				has_pending.wait(lock, [] { return stop_tracking || pending; });
+				if (!pending) return;
+				f.swap(pending);
+			}
+			f->index();
+			std::lock_guard<std::mutex> lock(is_tracking);
+			f->snapshot_id = ++current_id;
+		}
+	}
 	static void Main() {
-		current_id = returned_id = 1;
+		{
+			// The renderer reads the ring under is_tracking
+			std::lock_guard<std::mutex> lock(is_tracking);
+			for (auto & s : snapshots)
+				if (!s) s = std::make_shared<TrackedFrame>();
+		}
 		stop_tracking = false;
 		currently_tracking = true;
+		std::thread worker(Index);
 		while (!stop_tracking) {
+			// Reuse the oldest snapshot nobody else holds on to
+			std::shared_ptr<TrackedFrame> f;
 			{
 				std::lock_guard<std::mutex> lock(is_tracking);
-				current.fetch();
-				current_id += 1;
+				for (const auto & s : snapshots)
+					if (s.use_count() == 1 && (!f || s->snapshot_id < f->snapshot_id))
+						f = s;
+				if (f) f->snapshot_id = 0;
+			}
+			if (f) {
+				f->fetch();
+				f->time = trackerTime();
+				{
+					std::lock_guard<std::mutex> lock(is_tracking);
+					pending.swap(f);
+				}
+				has_pending.notify_one();
 			}
 			WAIT(0);
 		}
+		{
+			// Notify under the lock, the worker can not miss the stop between its predicate check and the wait
+			std::lock_guard<std::mutex> lock(is_tracking);
+			has_pending.notify_one();
+		}
+		worker.join();
 		currently_tracking = false;
 		TERMINATE();
 	}
-	static TrackedFrame * nextFrame() {
-		if (!current_id) return nullptr;
-		std::lock_guard<std::mutex> lock(is_tracking);
-		uint64_t delta = current_id - returned_id;
-		if (delta > 0) {
-			for (int i = 0; i < N_OBJECTS; i++) {
-				if (returned.objects[i].id == current.objects[i].id) {
-					returned.objects[i].age = current.objects[i].age = returned.objects[i].age + (uint32_t)delta;
-					returned.objects[i].p = current.objects[i].p;
-					returned.objects[i].q = current.objects[i].q;
-					// Let's associate the private data with the returned object only [no swapping here]
-				} else if (current.objects[i].id) {
-					returned.objects[i] = current.objects[i];
-				} else if (returned.objects[i].id) {
-					returned.objects[i].id = 0;
-					returned.objects[i].private_data.reset();
+	static TrackedFrame * nextFrame(double t) {
+		std::shared_ptr<TrackedFrame> next;
+		{
+			std::lock_guard<std::mutex> lock(is_tracking);
+			// Pick the snapshot closest to t (or the newest one), never go back in time
+			uint64_t min_id = returned ? returned->snapshot_id : 1;
+			for (const auto & s : snapshots)
+				if (s && s->snapshot_id >= min_id && (!next || (t > 0 ? fabs(s->time - t) < fabs(next->time - t) : s->snapshot_id > next->snapshot_id)))
+					next = s;
+		}
+		if (next && next != returned) {
+			if (returned) {
+				// Hand the private data over to the new snapshot [no copies of the snapshot itself]
+				uint32_t delta = (uint32_t)(next->snapshot_id - returned->snapshot_id);
+				for (uint32_t i : returned->occupied) {
+					TrackedFrame::Object & o = returned->objects[i], & n = next->objects[i];
+					if (o.id && o.id == n.id) {
+						n.age = o.age + delta;
+						n.private_data = std::move(o.private_data);
+					} else
+						o.private_data.reset();
 				}
 			}
-			returned.object_map.swap(current.object_map);
-			returned.info = current.info;
-			returned_id = current_id;
+			returned = next;
 		}
-		return &returned;
+		return returned.get();
 	}
 	static bool stop() {
 		stop_tracking = true;
@@ -66,14 +127,15 @@ bool stopTracker() {
 	return Tracker::stop();
 }
 std::mutex Tracker::is_tracking;
-TrackedFrame Tracker::current;
-TrackedFrame Tracker::returned;
-uint64_t Tracker::current_id = 0, Tracker::returned_id = 0;
-bool Tracker::stop_tracking = false;
+std::shared_ptr<TrackedFrame> Tracker::snapshots[N_SNAPSHOTS], Tracker::returned;
+uint64_t Tracker::current_id = 0;
+std::atomic<bool> Tracker::stop_tracking = { false };
 bool Tracker::currently_tracking = false;
+std::shared_ptr<TrackedFrame> Tracker::pending;
+std::condition_variable Tracker::has_pending;
 
-TrackedFrame * trackNextFrame() {
-	return Tracker::nextFrame();
+TrackedFrame * trackNextFrame(double time) {
+	return Tracker::nextFrame(time);
 }
 
 void initGTA5State(HMODULE hInstance) {
@@ -85,6 +147,50 @@ void releaseGTA5State(HMODULE hInstance) {
 
 TrackedFrame::TrackedFrame() :object_map(TRACKING_RAD) {}
 
+// A GameInfo probe, refreshed every period script ticks
+struct InfoProbe {
+	uint32_t period;
+	void(*update)(GameInfo & info, Player p, Ped pp);
+};
+static const InfoProbe info_probes[] = {
+	{ 1, [](GameInfo & info, Player p, Ped pp) {
+		Vector3 x = ENTITY::GET_OFFSET_FROM_ENTITY_IN_WORLD_COORDS(pp, 0.0, 0.0, 0.0);
+		info.position = { x.x, x.y, x.z };
+		x = ENTITY::GET_ENTITY_FORWARD_VECTOR(pp);
+		info.forward_vector = { x.x, x.y, x.z };
+		info.heading = ENTITY::GET_ENTITY_HEADING(pp);
+	} },
+	{ 1, [](GameInfo & info, Player p, Ped pp) {
+		info.on_foot = PED::IS_PED_ON_FOOT(pp);
+		info.in_vehicle = 2 * PED::IS_PED_GETTING_INTO_A_VEHICLE(pp) + PED::IS_PED_IN_ANY_VEHICLE(pp, true);
+		info.on_bike = PED::IS_PED_ON_ANY_BIKE(pp);
+	} },
+	{ 5, [](GameInfo & info, Player p, Ped pp) {
+		info.dead = PLAYER::IS_PLAYER_DEAD(p);
+	} },
+	{ 10, [](GameInfo & info, Player p, Ped pp) {
+		info.time_since_player_drove_against_traffic = PLAYER::GET_TIME_SINCE_PLAYER_DROVE_AGAINST_TRAFFIC(p);
+		info.time_since_player_drove_on_pavement = PLAYER::GET_TIME_SINCE_PLAYER_DROVE_ON_PAVEMENT(p);
+		info.time_since_player_hit_ped = PLAYER::GET_TIME_SINCE_PLAYER_HIT_PED(p);
+		info.time_since_player_hit_vehicle = PLAYER::GET_TIME_SINCE_PLAYER_HIT_VEHICLE(p);
+	} },
+	{ 30, [](GameInfo & info, Player p, Ped pp) {
+		// Let's assume we play with Franklyn all the time (the stat hash is only computed once)
+		static const Hash total_cash = GAMEPLAY::GET_HASH_KEY("SP1_TOTAL_CASH");
+		STATS::STAT_GET_INT(total_cash, &info.money, -1);
+	} },
+};
+
+// Model space bounds, queried once per model and shared by all its entities (script thread only)
+static ModelExtentCache model_extent([](uint32_t model) {
+	Vector3 lo, hi;
+	GAMEPLAY::GET_MODEL_DIMENSIONS(model, &lo, &hi);
+	return ModelExtent{ { lo.x, lo.y, lo.z }, { hi.x, hi.y, hi.z } };
+});
+
+// Model hash of the peds and vehicles of the last sweep by entity handle, only new entities query GET_ENTITY_MODEL (script thread only)
+static std::unordered_map<int, uint32_t> entity_model, last_entity_model;
+
 uint32_t ID(uint32_t id, TrackedFrame::ObjectType t) {
 	return ((uint32_t)t) << 28 | id;
 }
@@ -94,10 +200,14 @@ void TrackedFrame::fetch() {
 
 	static int entity_buf[1 << 14];
 
-	// Clear the tracker
-	object_map.clear();
-	for (int i = 0; i < N_OBJECTS; i++)
+	// Clear the tracker (only the slots used by the last sweep)
+	for (uint32_t i : occupied)
 		objects[i].id = 0;
+	occupied.clear();
+
+	// Entities that left the world are dropped from the model cache
+	std::swap(entity_model, last_entity_model);
+	entity_model.clear();
 
 	// Track all new objects
 	typedef int(*WorldGet)(int*, int);
@@ -117,34 +227,41 @@ void TrackedFrame::fetch() {
 			uint32_t k = (e >> 8) & (N_OBJECTS/2 - 1);
 			if (objects[k].id)
 				LOG(WARN) << "Tracker has duplicate objects";
+			else
+				occupied.push_back(k);
 			objects[k] = { ID(e, e == player_ped ? ObjectType::PLAYER : t), 0, {p.x, p.y, p.z}, q, nullptr };
-			object_map.insert({ objects[k].p.x, objects[k].p.y }, k);
+			if (t == PED || t == VEHICLE) {
+				auto it = last_entity_model.find(e);
+				const uint32_t model = it != last_entity_model.end() ? it->second : ENTITY::GET_ENTITY_MODEL(e);
+				entity_model[e] = model;
+				const ModelExtent & m = model_extent(model);
+				objects[k].lo = { m.lo[0], m.lo[1], m.lo[2] };
+				objects[k].hi = { m.hi[0], m.hi[1], m.hi[2] };
+			}
 			if (t == PED) { // Track the head gear
 				Vector3 hp = PED::GET_PED_BONE_COORDS(e, SKEL_Head, 0.0, 0.0, 0.0);
 				uint32_t kk = k + N_OBJECTS/2;
+				if (!objects[kk].id)
+					occupied.push_back(kk);
 				objects[kk] = { objects[k].id, 0,{ hp.x, hp.y, hp.z }, {0,0,0,0}, nullptr };
-				object_map.insert({ objects[kk].p.x, objects[kk].p.y }, kk);
 			}
 		}
 	}
+	// Refresh the game state probes that are due, the others carry over from the last sweep
+	static GameInfo latest = {};
+	static uint64_t tick = 0;
 	Player p = PLAYER::PLAYER_ID();
-	Ped pp = PLAYER::PLAYER_PED_ID();
-	info.time_since_player_drove_against_traffic = PLAYER::GET_TIME_SINCE_PLAYER_DROVE_AGAINST_TRAFFIC(p);
-	info.time_since_player_drove_on_pavement = PLAYER::GET_TIME_SINCE_PLAYER_DROVE_ON_PAVEMENT(p);
-	info.time_since_player_hit_ped = PLAYER::GET_TIME_SINCE_PLAYER_HIT_PED(p);
-	info.time_since_player_hit_vehicle = PLAYER::GET_TIME_SINCE_PLAYER_HIT_VEHICLE(p);
-	info.dead = PLAYER::IS_PLAYER_DEAD(p);
-	Vector3 x = ENTITY::GET_OFFSET_FROM_ENTITY_IN_WORLD_COORDS(pp, 0.0, 0.0, 0.0);
-	info.position = { x.x, x.y, x.z };
-	x = ENTITY::GET_ENTITY_FORWARD_VECTOR(pp);
-	info.forward_vector = { x.x, x.y, x.z };
-	info.heading = ENTITY::GET_ENTITY_HEADING(pp);
-	info.on_foot = PED::IS_PED_ON_FOOT(pp);
-	info.in_vehicle = 2*PED::IS_PED_GETTING_INTO_A_VEHICLE(pp) + PED::IS_PED_IN_ANY_VEHICLE(pp, true);
-	info.on_bike= PED::IS_PED_ON_ANY_BIKE(pp);
-
-	// Let's assume we play with Franklyn all the time
-	STATS::STAT_GET_INT(GAMEPLAY::GET_HASH_KEY("SP1_TOTAL_CASH"), &info.money, -1);
+	for (const InfoProbe & probe : info_probes)
+		if (tick % probe.period == 0)
+			probe.update(latest, p, player_ped);
+	tick++;
+	info = latest;
+}
+
+void TrackedFrame::index() {
+	object_map.clear();
+	for (uint32_t k : occupied)
+		object_map.insert({ objects[k].p.x, objects[k].p.y }, k);
 }
 
 //TrackedFrame::Object * TrackedFrame::operator[](uint32_t id) {
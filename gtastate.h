@@ -45,6 +45,8 @@ struct TrackedFrame {
 		Vec3f p;
 		Quaternion q;
 		std::shared_ptr<PrivateData> private_data;
+		// Model space bounds (peds and vehicles only, zero if unknown)
+		Vec3f lo = { 0, 0, 0 }, hi = { 0, 0, 0 };
 		ObjectType type() const;
 		uint32_t handle() const;
 	};
@@ -52,11 +54,19 @@ public:
 	friend struct Tracker;
 	Object objects[N_OBJECTS];
 	NNSearch2D<size_t> object_map;
+	// Slots used by the last fetch
+	std::vector<uint32_t> occupied;
+	// Sweep all entities (script thread only)
 	void fetch();
+	// Build the object_map from the sweep
+	void index();
+	uint64_t snapshot_id = 0;
 
 public:
 	TrackedFrame();
 	GameInfo info;
+	// Time the snapshot was taken (seconds since epoch)
+	double time = 0;
 	//Object * operator[](uint32_t id);
 	//const Object * operator[](uint32_t id) const;
 	Object * operator()(const Vec3f & v, const Quaternion & q);
@@ -65,5 +75,6 @@ public:
 	const Object * operator()(const Vec3f & v, const Quaternion & q) const;
 };
 
-TrackedFrame * trackNextFrame();
+// Returns the tracker snapshot closest to time (or the newest snapshot if time is 0)
+TrackedFrame * trackNextFrame(double time = 0);
 bool stopTracker();
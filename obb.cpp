@@ -0,0 +1,101 @@
+#include "obb.h"
+#include <algorithm>
+#include <emmintrin.h>
+
+const ModelExtent & ModelExtentCache::operator()(uint32_t model) {
+	auto it = cache_.find(model);
+	if (it == cache_.end())
+		it = cache_.insert({ model, query_(model) }).first;
+	return it->second;
+}
+
+void orientedBoxes(const float * p, const float * q, const float * lo, const float * hi, size_t n, float * corners) {
+	const __m128 one = _mm_set_ps1(1.f), two = _mm_set_ps1(2.f);
+	for (size_t i = 0; i < n; i += 4) {
+		// Transpose 4 objects into SSE lanes
+		float v[13][4] = { 0 };
+		size_t m = std::min<size_t>(4, n - i);
+		for (size_t k = 0; k < m; k++) {
+			for (int j = 0; j < 3; j++) {
+				v[j][k] = p[3 * (i + k) + j];
+				v[7 + j][k] = lo[3 * (i + k) + j];
+				v[10 + j][k] = hi[3 * (i + k) + j];
+			}
+			for (int j = 0; j < 4; j++)
+				v[3 + j][k] = q[4 * (i + k) + j];
+		}
+		const __m128 X = _mm_loadu_ps(v[0]), Y = _mm_loadu_ps(v[1]), Z = _mm_loadu_ps(v[2]);
+		const __m128 QX = _mm_loadu_ps(v[3]), QY = _mm_loadu_ps(v[4]), QZ = _mm_loadu_ps(v[5]), QW = _mm_loadu_ps(v[6]);
+		// Rotation matrix of the (unit) quaternion
+		const __m128 xx = _mm_mul_ps(QX, QX), yy = _mm_mul_ps(QY, QY), zz = _mm_mul_ps(QZ, QZ);
+		const __m128 xy = _mm_mul_ps(QX, QY), xz = _mm_mul_ps(QX, QZ), yz = _mm_mul_ps(QY, QZ);
+		const __m128 xw = _mm_mul_ps(QX, QW), yw = _mm_mul_ps(QY, QW), zw = _mm_mul_ps(QZ, QW);
+		const __m128 R[3][3] = {
+			{ _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), _mm_mul_ps(two, _mm_sub_ps(xy, zw)), _mm_mul_ps(two, _mm_add_ps(xz, yw)) },
+			{ _mm_mul_ps(two, _mm_add_ps(xy, zw)), _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), _mm_mul_ps(two, _mm_sub_ps(yz, xw)) },
+			{ _mm_mul_ps(two, _mm_sub_ps(xz, yw)), _mm_mul_ps(two, _mm_add_ps(yz, xw)), _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))) } };
+		const __m128 P[3] = { X, Y, Z };
+		for (int o = 0; o < 8; o++) {
+			const __m128 x = _mm_loadu_ps(v[(o & 1) ? 10 : 7]), y = _mm_loadu_ps(v[(o & 2) ? 11 : 8]), z = _mm_loadu_ps(v[(o & 4) ? 12 : 9]);
+			float r[3][4];
+			for (int j = 0; j < 3; j++)
+				_mm_storeu_ps(r[j], _mm_add_ps(P[j], _mm_add_ps(_mm_mul_ps(R[j][0], x), _mm_add_ps(_mm_mul_ps(R[j][1], y), _mm_mul_ps(R[j][2], z)))));
+			for (size_t k = 0; k < m; k++)
+				for (int j = 0; j < 3; j++)
+					corners[24 * (i + k) + 3 * o + j] = r[j][k];
+		}
+	}
+}
+
+void projectBoxes(const float P[16], const float * corners, size_t n, float W, float H, Box2f * out) {
+	const float NEAR_W = 1e-3f;
+	const __m128 one = _mm_set_ps1(1.f), mone = _mm_set_ps1(-1.f), near_w = _mm_set_ps1(NEAR_W), all = _mm_castsi128_ps(_mm_set1_epi32(-1));
+	// Row vector convention: clip = [x y z 1] * P
+	auto dot = [&P](__m128 x, __m128 y, __m128 z, int c) {
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set_ps1(P[c])), _mm_mul_ps(y, _mm_set_ps1(P[4 + c]))), _mm_add_ps(_mm_mul_ps(z, _mm_set_ps1(P[8 + c])), _mm_set_ps1(P[12 + c])));
+	};
+	for (size_t i = 0; i < n; i += 4) {
+		size_t m = std::min<size_t>(4, n - i);
+		__m128 x0 = _mm_set_ps1(1e10f), y0 = _mm_set_ps1(1e10f), x1 = _mm_set_ps1(-1e10f), y1 = _mm_set_ps1(-1e10f), behind = _mm_setzero_ps(), front = _mm_setzero_ps(), depth = _mm_setzero_ps();
+		for (int o = 0; o < 8; o++) {
+			// Transpose corner o of 4 objects into SSE lanes
+			float c[3][4] = { 0 };
+			for (size_t k = 0; k < m; k++)
+				for (int j = 0; j < 3; j++)
+					c[j][k] = corners[24 * (i + k) + 3 * o + j];
+			const __m128 x = _mm_loadu_ps(c[0]), y = _mm_loadu_ps(c[1]), z = _mm_loadu_ps(c[2]);
+			const __m128 px = dot(x, y, z, 0), py = dot(x, y, z, 1), pw = dot(x, y, z, 3);
+			depth = _mm_add_ps(depth, pw);
+			const __m128 b = _mm_cmple_ps(pw, near_w);
+			behind = _mm_or_ps(behind, b);
+			front = _mm_or_ps(front, _mm_andnot_ps(b, all));
+			const __m128 iw = _mm_div_ps(one, _mm_max_ps(pw, near_w)), sx = _mm_mul_ps(px, iw), sy = _mm_mul_ps(py, iw);
+			// Corners behind the camera do not contribute, they widen the box to the screen border below
+			x0 = _mm_min_ps(x0, _mm_or_ps(_mm_and_ps(b, x0), _mm_andnot_ps(b, sx)));
+			y0 = _mm_min_ps(y0, _mm_or_ps(_mm_and_ps(b, y0), _mm_andnot_ps(b, sy)));
+			x1 = _mm_max_ps(x1, _mm_or_ps(_mm_and_ps(b, x1), _mm_andnot_ps(b, sx)));
+			y1 = _mm_max_ps(y1, _mm_or_ps(_mm_and_ps(b, y1), _mm_andnot_ps(b, sy)));
+		}
+		// Partially clipped boxes cover the entire screen (conservative)
+		const __m128 partial = _mm_and_ps(behind, front);
+		x0 = _mm_or_ps(_mm_and_ps(partial, mone), _mm_andnot_ps(partial, x0));
+		y0 = _mm_or_ps(_mm_and_ps(partial, mone), _mm_andnot_ps(partial, y0));
+		x1 = _mm_or_ps(_mm_and_ps(partial, one), _mm_andnot_ps(partial, x1));
+		y1 = _mm_or_ps(_mm_and_ps(partial, one), _mm_andnot_ps(partial, y1));
+		const __m128 visible = _mm_and_ps(front, _mm_and_ps(_mm_and_ps(_mm_cmple_ps(x0, one), _mm_cmpge_ps(x1, mone)), _mm_and_ps(_mm_cmple_ps(y0, one), _mm_cmpge_ps(y1, mone))));
+		x0 = _mm_and_ps(visible, _mm_max_ps(x0, mone)); y0 = _mm_and_ps(visible, _mm_max_ps(y0, mone));
+		x1 = _mm_and_ps(visible, _mm_min_ps(x1, one)); y1 = _mm_and_ps(visible, _mm_min_ps(y1, one));
+		// Convert to pixels (same convention as ps_flow)
+		const __m128 hw = _mm_set_ps1(0.5f * W), hh = _mm_set_ps1(0.5f * H);
+		float r[6][4];
+		_mm_storeu_ps(r[0], _mm_mul_ps(_mm_add_ps(x0, one), hw));
+		_mm_storeu_ps(r[1], _mm_mul_ps(_mm_sub_ps(one, y1), hh));
+		_mm_storeu_ps(r[2], _mm_mul_ps(_mm_add_ps(x1, one), hw));
+		_mm_storeu_ps(r[3], _mm_mul_ps(_mm_sub_ps(one, y0), hh));
+		// The depth of the box center is the mean depth of its corners
+		_mm_storeu_ps(r[4], _mm_mul_ps(depth, _mm_set_ps1(0.125f)));
+		_mm_storeu_ps(r[5], visible);
+		for (size_t k = 0; k < m; k++)
+			out[i + k] = { r[0][k], r[1][k], r[2][k], r[3][k], r[4][k], r[5][k] != 0 };
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+// Oriented 3D boxes of tracked objects and their screen space projection (no SDK or game dependencies)
+
+struct Box2f {
+	float x0, y0, x1, y1; // Screen space box in pixels (clipped to the screen)
+	float depth; // View space depth of the center
+	int visible; // Does the box overlap the view frustum
+};
+
+// Model space bounds of a model
+struct ModelExtent {
+	float lo[3], hi[3];
+};
+// Model bounds by model hash, each model is queried once and shared by all its entities (not thread safe)
+class ModelExtentCache {
+public:
+	typedef std::function<ModelExtent(uint32_t model)> Query;
+	// query is called on the first use of a model (GET_MODEL_DIMENSIONS in the game)
+	ModelExtentCache(Query query) :query_(query) {}
+	const ModelExtent & operator()(uint32_t model);
+	size_t size() const { return cache_.size(); }
+protected:
+	Query query_;
+	std::unordered_map<uint32_t, ModelExtent> cache_;
+};
+
+// Corners of n oriented boxes with pose p (xyz), q (quaternion xyzw) and model space bounds [lo, hi] (xyz)
+// Writes 8 corners (24 floats) per box, corner k uses hi for x if bit 0 is set, for y if bit 1 is set and for z if bit 2 is set
+void orientedBoxes(const float * p, const float * q, const float * lo, const float * hi, size_t n, float * corners);
+// Project n boxes (8 corners each) onto a W x H screen using a (row major, row vector) view_proj matrix
+void projectBoxes(const float view_proj[16], const float * corners, size_t n, float W, float H, Box2f * out);
@@ -27,7 +27,7 @@ bool CBufferVariable::scan(std::shared_ptr<Shader> s) {
 		if (!cbuffer_name.size() || cb.name == cbuffer_name)
 			for (const auto & v : cb.variables)
 				if (!variable_name.size() || v.name == variable_name) {
-					position_hash_[s->hash()] = { cb.bind_point, v.offset };
+					position_hash_[s->hash()] = { cb.bind_point, v.offset, v.size };
 					return true;
 				}
 	return false;
@@ -44,6 +44,8 @@ std::shared_ptr<GPUMemory> CBufferVariable::fetch(GameController * c, const Shad
 		for (auto & j : o) j += i->second.offset;
 		return c->readBuffer(cbuffers[i->second.bind_point], o, size_, immediate);
 	}
+	if (!size_.size() && i != position_hash_.end() && i->second.size && i->second.bind_point < cbuffers.size())
+		return c->readBuffer(cbuffers[i->second.bind_point], { i->second.offset }, { i->second.size }, immediate);
 	return std::shared_ptr<GPUMemory>();
 }
 
@@ -111,6 +113,18 @@ std::string toJSON(const Vec2f & v) {
 std::string toJSON(const Vec3f & v) {
 	return "[" + std::to_string(v.x) + "," + std::to_string(v.y) + "," + std::to_string(v.z) + "]";
 }
+std::string toJSON(const Box2f & b) {
+	return "{\"box\":[" + std::to_string(b.x0) + "," + std::to_string(b.y0) + "," + std::to_string(b.x1) + "," + std::to_string(b.y1) + "],\"depth\":" + std::to_string(b.depth) + ",\"visible\":" + std::to_string(b.visible) + "}";
+}
+void addJSON(std::string * obj, const std::string & key, const std::string & value) {
+	size_t e = obj->find_last_of('}');
+	if (e == std::string::npos) {
+		*obj = "{\"" + key + "\":" + value + "}";
+		return;
+	}
+	size_t b = obj->find_last_not_of(" \t\n", e - 1);
+	obj->insert(e, std::string(b != std::string::npos && (*obj)[b] != '{' ? "," : "") + "\"" + key + "\":" + value);
+}
 std::string toJSON(const Quaternion & v) {
 	return "[" + std::to_string(v.x) + "," + std::to_string(v.y) + "," + std::to_string(v.z) + "," + std::to_string(v.w) + "]";
 }
@@ -2,10 +2,11 @@
 #include <string>
 #include <unordered_map>
 #include "sdk.h"
+#include "obb.h"
 
 struct CBufferVariable {
 	struct Location {
-		uint32_t bind_point, offset;
+		uint32_t bind_point, offset, size;
 	};
 	std::string cbuffer_name, variable_name;
 	std::vector<size_t> offset_, size_;
@@ -14,7 +15,7 @@ struct CBufferVariable {
 	CBufferVariable(const std::string & cbuffer_name, const std::string & variable_name, const std::vector<size_t> & offset, const std::vector<size_t> & size);
 	bool scan(std::shared_ptr<Shader> s);
 	bool has(const ShaderHash & h);
-	
+	// Reads the offset/size blocks given in the constructor, or the entire variable (as reflected) if none were given
 	std::shared_ptr<GPUMemory> fetch(GameController * c, const ShaderHash & h, const std::vector<Buffer> & cbuffers, bool immediate = false) const;
 };
 
@@ -50,6 +51,11 @@ struct Vec3f {
 };
 std::string toJSON(const Vec3f & v);
 
+// Append a "key": value entry to the JSON object in obj
+void addJSON(std::string * obj, const std::string & key, const std::string & value);
+
+std::string toJSON(const Box2f & b);
+
 struct Quaternion {
 	static Quaternion fromMatrix(const float4x4 & m);
 	float x, y, z, w;